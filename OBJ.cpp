@@ -17,17 +17,66 @@
 #include <ios>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <fstream>
 #include <ostream>
+#include <sstream>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <format>
 #include <chrono>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <limits>
+#include <bit>
+#include <charconv>
+#include <optional>
+#include <filesystem>
+#include <random>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
 #include <assert.h>
 #include <stdint.h>
 #include <math.h>
 
+// SSE2 is part of every x86-64 target, the scalar code is used everywhere else
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define PJ1_SSE2
+	#include <emmintrin.h>
+#endif
+
+// thread affinity
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#define NOGDI
+	#include <windows.h>
+#elif defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+// hardware counters of the stage report
+#if defined(PJ1_PROFILE) && defined(__linux__)
+	#include <linux/perf_event.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+// AVX2 only when the compiler targets it, e.g. -march=native or /arch:AVX2
+#if defined(__AVX2__)
+	#define PJ1_AVX2
+	#include <immintrin.h>
+#endif
+
 // bitmap file loader by Benjamin Kalytta
 // http://www.kalytta.com/bitmap.h 
 
@@ -108,13 +157,132 @@ typedef struct _BGRA {
 
 #pragma pack(pop)
 
+// owns a heap array of trivially copyable T, aligned for SIMD loads. move only.
+template <class T>
+class AlignedBuffer {
+public:
+	static constexpr size_t Alignment = 64;
+
+	AlignedBuffer() : m_Data(0), m_Size(0) {}
+
+	explicit AlignedBuffer(size_t Size) : m_Data(0), m_Size(Size) {
+		if (Size) {
+			m_Data = static_cast<T*>(::operator new[](Size * sizeof(T), std::align_val_t(Alignment)));
+		}
+	}
+
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+	AlignedBuffer(AlignedBuffer&& Other) noexcept : m_Data(std::exchange(Other.m_Data, nullptr)), m_Size(std::exchange(Other.m_Size, 0)) {}
+
+	AlignedBuffer& operator=(AlignedBuffer&& Other) noexcept {
+		if (this != &Other) {
+			Release();
+			m_Data = std::exchange(Other.m_Data, nullptr);
+			m_Size = std::exchange(Other.m_Size, 0);
+		}
+		return *this;
+	}
+
+	~AlignedBuffer() {
+		Release();
+	}
+
+	T* Data() const {
+		return m_Data;
+	}
+
+	size_t Size() const {
+		return m_Size;
+	}
+
+private:
+	void Release() {
+		if (m_Data) {
+			::operator delete[](m_Data, std::align_val_t(Alignment));
+			m_Data = 0;
+		}
+		m_Size = 0;
+	}
+
+	T* m_Data;
+	size_t m_Size;
+};
+
+// 64-bit hash of pixel data for cache keys, not for security. streams: the bytes may come in pieces of any
+// size, e.g. a row at a time while a bitmap is decoded, and hash the same as in one piece. four lanes of
+// the xxHash64 round take 32 bytes at a time.
+class PixelHash {
+public:
+	void Update(const void* Data, size_t Size) {
+		const uint8_t* Bytes = static_cast<const uint8_t*>(Data);
+		m_Length += Size;
+
+		if (m_Pending) {
+			size_t Take = std::min(Size, sizeof(m_Block) - m_Pending);
+			memcpy(m_Block + m_Pending, Bytes, Take);
+			m_Pending += Take;
+			Bytes += Take;
+			Size -= Take;
+			if (m_Pending < sizeof(m_Block)) {
+				return;
+			}
+			Consume(m_Block);
+			m_Pending = 0;
+		}
+
+		for (; Size >= sizeof(m_Block); Bytes += sizeof(m_Block), Size -= sizeof(m_Block)) {
+			Consume(Bytes);
+		}
+
+		memcpy(m_Block, Bytes, Size);
+		m_Pending = Size;
+	}
+
+	uint64_t Digest() const {
+		uint64_t Hash = std::rotl(m_Lanes[0], 1) + std::rotl(m_Lanes[1], 7) + std::rotl(m_Lanes[2], 12) + std::rotl(m_Lanes[3], 18);
+		Hash += m_Length;
+		for (size_t k = 0; k < m_Pending; ++k) {
+			Hash = std::rotl(Hash ^ (m_Block[k] * Prime5), 11) * Prime1;
+		}
+		Hash ^= Hash >> 33;
+		Hash *= Prime2;
+		Hash ^= Hash >> 29;
+		Hash *= Prime3;
+		Hash ^= Hash >> 32;
+		return Hash;
+	}
+
+private:
+	static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+	static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+	static constexpr uint64_t Prime3 = 0x165667B19E3779F9ull;
+	static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+	void Consume(const uint8_t* Block) {
+		for (int k = 0; k < 4; ++k) {
+			uint64_t Word;
+			memcpy(&Word, Block + 8 * k, 8);
+			m_Lanes[k] = std::rotl(m_Lanes[k] + Word * Prime2, 31) * Prime1;
+		}
+	}
+
+	uint64_t m_Lanes[4] = {Prime1 + Prime2, Prime2, 0, 0 - Prime1};
+	uint64_t m_Length = 0;
+	uint8_t m_Block[32];
+	size_t m_Pending = 0;
+};
+
 // read and write bitmap files
 class CBitmap {
 public:
 	BITMAP_FILEHEADER m_BitmapFileHeader;
 	BITMAP_HEADER m_BitmapHeader;
-	RGBA *m_BitmapData;
+	RGBA *m_BitmapData;         // points into m_BitmapBuffer
 	unsigned int m_BitmapSize;	
+	AlignedBuffer<RGBA> m_BitmapBuffer;
+	uint64_t m_PixelHash;       // PixelHash of the rows as they were loaded
 	// Masks and bit counts shouldn't exceed 32 Bits
 public:
 	class CColor {
@@ -167,15 +335,61 @@ public:
 	~CBitmap() {
 		Dispose();
 	}
+
+	/* Bitmaps are moved, not copied. Use Clone() for an explicit deep copy */
+
+	CBitmap(const CBitmap&) = delete;
+	CBitmap& operator=(const CBitmap&) = delete;
+
+	CBitmap(CBitmap&& Other) noexcept : m_BitmapData(0), m_BitmapSize(0) {
+		*this = std::move(Other);
+	}
+
+	CBitmap& operator=(CBitmap&& Other) noexcept {
+		if (this != &Other) {
+			m_BitmapFileHeader = Other.m_BitmapFileHeader;
+			m_BitmapHeader = Other.m_BitmapHeader;
+			m_BitmapBuffer = std::move(Other.m_BitmapBuffer);
+			m_BitmapData = std::exchange(Other.m_BitmapData, nullptr);
+			m_BitmapSize = std::exchange(Other.m_BitmapSize, 0);
+			m_PixelHash = Other.m_PixelHash;
+			Other.Dispose();
+		}
+		return *this;
+	}
+
+	CBitmap Clone() const {
+		CBitmap Copy;
+		Copy.m_BitmapFileHeader = m_BitmapFileHeader;
+		Copy.m_BitmapHeader = m_BitmapHeader;
+		Copy.Allocate(m_BitmapSize);
+		Copy.m_PixelHash = m_PixelHash;
+		if (m_BitmapSize) {
+			memcpy(Copy.m_BitmapData, m_BitmapData, m_BitmapSize * sizeof(RGBA));
+		}
+		return Copy;
+	}
+
+	/* Moves the bitmap into a read-only handle that can be shared between threads and stages */
+
+	std::shared_ptr<const CBitmap> Share() && {
+		return std::make_shared<const CBitmap>(std::move(*this));
+	}
 	
 	void Dispose() {
-		if (m_BitmapData) {
-			delete[] m_BitmapData;
-			m_BitmapData = 0;
-		}
+		m_BitmapBuffer = AlignedBuffer<RGBA>();
+		m_BitmapData = 0;
+		m_BitmapSize = 0;
+		m_PixelHash = 0;
 		memset(&m_BitmapFileHeader, 0, sizeof(m_BitmapFileHeader));
 		memset(&m_BitmapHeader, 0, sizeof(m_BitmapHeader));
 	}
+
+	void Allocate(unsigned int Size) {
+		m_BitmapBuffer = AlignedBuffer<RGBA>(Size);
+		m_BitmapData = m_BitmapBuffer.Data();
+		m_BitmapSize = Size;
+	}
 	
 	/* Load specified Bitmap and stores it as RGBA in an internal buffer */
 	
@@ -221,8 +435,7 @@ public:
 
 		/* ... Color Table for 16 bits images are not supported yet */	
 		
-		m_BitmapSize = GetWidth() * GetHeight();
-		m_BitmapData = new RGBA[m_BitmapSize];
+		Allocate(GetWidth() * GetHeight());
 		
 		unsigned int LineWidth = ((GetWidth() * GetBitCount() / 8) + 3) & ~3;
 		uint8_t *Line = new uint8_t[LineWidth];
@@ -231,6 +444,7 @@ public:
 
 		int Index = 0;
 		bool Result = true;
+		PixelHash Hash;
 
 		if (m_BitmapHeader.Compression == 0) {
 			for (unsigned int i = 0; i < GetHeight(); i++) {
@@ -299,6 +513,9 @@ public:
 						LinePtr += 4;
 					}
 				}
+
+				// while the row is still in the cache
+				Hash.Update(m_BitmapData + i * GetWidth(), GetWidth() * sizeof(RGBA));
 			}
 		} else if (m_BitmapHeader.Compression == 1) { // RLE 8
 			uint8_t Count = 0;
@@ -387,8 +604,16 @@ public:
 
 					Index++;
 				}
+
+				Hash.Update(m_BitmapData + i * GetWidth(), GetWidth() * sizeof(RGBA));
 			}
 		}
+
+		// RLE 8 writes the rows out of order
+		if (m_BitmapHeader.Compression == 1) {
+			Hash.Update(m_BitmapData, m_BitmapSize * sizeof(RGBA));
+		}
+		m_PixelHash = Hash.Digest();
 		
 		delete [] ColorTable;
 		delete [] Line;
@@ -440,6 +665,10 @@ public:
 		bh.Height = GetHeight();
 		bh.Width = GetWidth();
 		bh.SizeImage = (LineWidth * BitCount * GetHeight()) / 8;
+		if (BitCount == 32) {
+			/* 32 bit rows are already 4 byte aligned, m_BitmapData holds exactly this much */
+			bh.SizeImage = GetWidth() * GetHeight() * 4;
+		}
 		bh.PelsPerMeterX = 3780;
 		bh.PelsPerMeterY = 3780;
 		
@@ -500,6 +729,12 @@ public:
 		return Result;
 	}
 
+	/* PixelHash of the pixels as they were loaded, drawing into the bitmap does not change it */
+
+	uint64_t GetPixelHash() const {
+		return m_PixelHash;
+	}
+
 	unsigned int GetWidth() const {
 		/* Add plausibility test */
 		// if (abs(m_BitmapHeader.Width) > 8192) {
@@ -744,8 +979,7 @@ public:
 		m_BitmapHeader.BitCount = 32;
 		m_BitmapHeader.Compression = 3; 
 
-		m_BitmapSize = GetWidth() * GetHeight();
-		m_BitmapData = new RGBA[m_BitmapSize];
+		Allocate(GetWidth() * GetHeight());
 		
 		/* Find bit count by masks (rounded to next 8 bit boundary) */
 		
@@ -817,80 +1051,146 @@ public:
 
 
 
-// a simple matrix class to denote a pixel's coordinate (x, y)
+// a non-owning view of a 2D pixel buffer, the top left corner is (0, 0).
+// stride is counted in elements of T and can be negative, which is how the bottom-up rows of a CBitmap
+// are presented top-down without copying. pixel (x, y) channel c is view[y][x * channels + c].
 template <class T>
-class matrix
+struct ImageView
 {
-public:
-    matrix(unsigned int rows, unsigned int cols) : rows(rows), cols(cols)
-    {
-        allocSpace();
-    }
-
-    // correspond to the coordinate system
-    matrix(uint8_t* data, unsigned int rows, unsigned int cols) : rows(rows), cols(cols)
-    {
-        allocSpace();
-        for (unsigned int i = 0; i < rows; ++i)
-        {
-            for (unsigned int j = 0; j < cols; ++j)
-            {
-                p[i][j] = data[(rows - i - 1) * cols + j];
-            }
-        }
-    }
-
-    ~matrix()
-    {
-        for (unsigned int i = 0; i < rows; ++i)
-        {
-            delete[] p[i];
-        }
-        delete[] p;
-    }
-
-    T* operator[](unsigned int x)
-    {
-        return p[x];
-    }
+	T* data = nullptr;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	std::ptrdiff_t stride = 0;
+	unsigned int channels = 1;
 
-private:
-    inline void allocSpace()
-    {
-        p = new T* [rows];
-        for (unsigned int i = 0; i < rows; ++i)
-        {
-            p[i] = new T[cols];
-        }
-    }
-
-    unsigned int rows;
-    unsigned int cols;
-    T** p;
+	T* Row(unsigned int y) const
+	{
+		return data + static_cast<std::ptrdiff_t>(y) * stride;
+	}
 
-};
+	T* operator[](unsigned int y) const
+	{
+		return Row(y);
+	}
 
+	unsigned int GetSize() const
+	{
+		return width * height;
+	}
 
+	bool Empty() const
+	{
+		return data == nullptr || width == 0 || height == 0;
+	}
 
+	ImageView Crop(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const
+	{
+		return {Row(y) + x * channels, w, h, stride, channels};
+	}
 
+	operator ImageView<const T>() const requires (!std::is_const_v<T>)
+	{
+		return {data, width, height, stride, channels};
+	}
+};
 
+// owns a tightly packed, aligned buffer for an ImageView. Resize() keeps the allocation when the image
+// shrinks, so one Image can be reused as scratch memory for every scale.
+template <class T>
+class Image
+{
+public:
+	Image() = default;
 
+	Image(unsigned int width, unsigned int height, unsigned int channels = 1)
+	{
+		Resize(width, height, channels);
+	}
 
+	void Resize(unsigned int width, unsigned int height, unsigned int channels = 1)
+	{
+		this->width = width;
+		this->height = height;
+		this->channels = channels;
 
+		size_t size = static_cast<size_t>(width) * height * channels;
+		if (size > buffer.Size())
+			buffer = AlignedBuffer<T>(size);
+	}
 
+	ImageView<T> View()
+	{
+		return {buffer.Data(), width, height, static_cast<std::ptrdiff_t>(width) * channels, channels};
+	}
 
+	ImageView<const T> View() const
+	{
+		return {buffer.Data(), width, height, static_cast<std::ptrdiff_t>(width) * channels, channels};
+	}
 
+	unsigned int GetWidth() const { return width; }
+	unsigned int GetHeight() const { return height; }
+	unsigned int GetChannels() const { return channels; }
 
+private:
+	AlignedBuffer<T> buffer;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int channels = 1;
+};
 
+// the RGBA pixels of a bitmap as a 4-channel byte view. the rows are stored bottom-up in m_BitmapData.
+inline ImageView<uint8_t> BitmapView(CBitmap* bmp)
+{
+	unsigned int width = bmp->GetWidth();
+	unsigned int height = bmp->GetHeight();
+	if (height == 0) return {};
 
+	auto bottom_up = reinterpret_cast<uint8_t*>(bmp->m_BitmapData);
+	auto stride = static_cast<std::ptrdiff_t>(width) * 4;
+	return {bottom_up + (height - 1) * stride, width, height, -stride, 4};
+}
 
-//****************************************************************************************************************//
+inline ImageView<const uint8_t> BitmapView(const CBitmap* bmp)
+{
+	return BitmapView(const_cast<CBitmap*>(bmp));
+}
 
+// binomial pyramid of a gray plane. level 0 is the base and every level is the previous one filtered with
+// the 5-tap binomial kernel and halved along the chosen axes, see PyrDown(). all levels live in one
+// allocation, every row starts on a 16 byte boundary.
+class Pyramid
+{
+public:
+	// Layout(), a copy of gray as the base and Reduce()
+	void Build(ImageView<const uint8_t> gray, unsigned int max_levels, bool halve_x = true, bool halve_y = true);
 
+	// places up to max_levels levels of a width x height base, they stop at 1 pixel. keeps the allocation
+	// when the new levels fit into it. the base is left to the caller, Reduce() makes the rest from it
+	void Layout(unsigned int width, unsigned int height, unsigned int max_levels, bool halve_x = true, bool halve_y = true);
+	void Reduce();
 
+	ImageView<uint8_t> Base()
+	{
+		return levels[0];
+	}
 
+	unsigned int Levels() const
+	{
+		return static_cast<unsigned int>(levels.size());
+	}
 
+	ImageView<const uint8_t> Level(unsigned int i) const
+	{
+		return levels[i];
+	}
 
+private:
+	AlignedBuffer<uint8_t> buffer;
+	std::vector<ImageView<uint8_t>> levels;
+	bool halve_x = true;
+	bool halve_y = true;
+};
 
 
 
@@ -905,535 +1205,4019 @@ private:
 
 
 
-// output format for this project
-struct OUTPUTFORMAT
-{
-	unsigned int x;
-	unsigned int y;
-	float accuracy;
-	float IoU;
 
-	// not for output
-	unsigned int templ_scaled_width;
-	unsigned int templ_scaled_height;
-};
 
-// function declaration
-uint8_t R8G8B8A82GR(RGBA rgba);
-void DrawRectangle(unsigned int x, unsigned int y, unsigned int width, unsigned int height);
-void GenerateGaryscaleImage(CBitmap* bmp, uint8_t* gray_buffer);
-void GaussianFilter(CBitmap* bmp);
-void GaussianFilterNTimes(CBitmap* bmp, unsigned int times);
-void DownSample(CBitmap* bmp);                           // half the width and height, this function is now useless.
-void DownSampleNTimes(CBitmap* bmp, unsigned int times); // same as above
-void NearestScaling(CBitmap* bmp, float scaleWidth, float scaleHeight);
-bool DescendingWithAccuracy(OUTPUTFORMAT a, OUTPUTFORMAT b);
-int Clamp(int x, int min, int max);
-void TemplateMatching(int num, bool save = false);
+//****************************************************************************************************************//
 
-// global varibles
-static std::unique_ptr<CBitmap> image_bmp;
-static std::unique_ptr<CBitmap> templ_bmp;
-static std::string image_name;
-static std::string templ_name;
 
-// ground truth
-struct coordinates
-{
-	unsigned int x;
-	unsigned int y;
-};
 
-// match manually
-static coordinates ground_truth[101] = 
-{{537, 420}, {782, 392}, {562, 375}, {1000, 232}, {456, 396},
- {331, 388}, {1070, 390}, {432, 362}, {992, 440}, {451, 408},
-{1, 289}, {1424, 375}, {1281, 398}, {558, 317}, {1413, 400},
-{486, 331}, {773, 333}, {320, 358}, {538, 368}, {353, 315},
-{1118, 361}, {317, 586}, {363, 576}, {4, 598}, {196, 420},
-{513, 348}, {1378, 409}, {430, 526}, {935, 319}, {789, 411},
-{1175, 385}, {653, 410}, {642, 364}, {845, 330}, {1216, 349},
-{350, 414}, {134, 340}, {362, 347}, {1127, 331}, {1138, 470},
-{666, 364}, {242, 223}, {612, 443}, {208, 381}, {1313, 333},
-{1088, 369}, {321, 270}, {1640, 391},{914, 364}, {3, 363},
-{1092, 238}, {794, 398}, {20, 355}, {1071, 311}, {118, 345},
-{1076, 219},{540, 288}, {639, 379}, {829, 262}, {56, 293},
-{1092, 370}, {586, 463}, {857, 408}, {1113, 461}, {940, 481},
-{191, 263}, {530, 359}, {1127, 327}, {1140, 355}, {420, 465},
-{395, 464}, {719, 1}, {733, 651}, {946, 495}, {571, 434},
-{738, 293}, {980, 145}, {797, 591}, {855, 1}, {357, 263},
-{718, 276}, {244, 644}, {352, 273}, {1069, 548}, {473, 461},
-{66, 396}, {550, 160}, {198, 371}, {403, 374}, {428, 400},
-{672, 377}, {1038, 285}, {23, 344}, {8, 370}, {827, 368},
-{1050, 250}, {1122, 358}, {526, 380}, {692, 274}, {927, 214},
-{155, 317}};
 
 
 
-// the main function
-int main(int argc, char** argv){
 
-	// only for debug, you can just ignore it.
-	// output the basic .txt and a source image with bounding boxes.  
-	// some images cannot be output,(such as test002.bmp and test003.bmp), which is caused by the Save(const char*)  
-	// function in CBitmap class. And I am not going to fix it.
-	// e.g.  Terminal:
-	// D:pj1\build> .\pj1.exe 1
-	// it will automatically search for the test001.bmp and obj001.bmp, then output debug information.
-	if (argc == 2)
-	{
-		int id = std::stoi(argv[1]);
-		if (id < 1 || id > 100) return 0;
 
-		image_name = std::format("test{:03}.bmp", id);
-		templ_name = std::format("obj{:03}.bmp", id);
 
-		std::clog << "\rimages remaining: " << 1 << ' ' << std::flush;
-		TemplateMatching(id, true);
 
-		return 0;
-	}
 
-	// match for input1.bmp
-	image_name = "input1.bmp";
-	templ_name = "input2.bmp";
 
-	std::clog << "\rimages remaining: " << 1 << ' ' << std::flush;
-	TemplateMatching(0);
 
 
-	// match for test001.bmp ~ test100.bmp
-	
-	// for (int m = 1; m < 101; ++m)
-	// {
-	// 	std::clog << "\rimages remaining: " << 101 - m << ' ' << std::flush;
-	// 	image_name = std::format("test{:03}.bmp", m);
-	// 	templ_name = std::format("obj{:03}.bmp", m);
 
-	// 	TemplateMatching(m);	
-	// }
 
-	return 0;
-	
-}
 
 
-uint8_t R8G8B8A82GR(RGBA rgba)
+
+
+// per stage report of thread time and, on Linux, hardware counters: cycles, instructions, L1D read misses,
+// last level cache misses and branch misses. PJ1_STAGE(Name); counts the rest of the enclosing block on the
+// calling thread, stages must not nest. without PJ1_PROFILE (the CMake option) all of it compiles away.
+#ifdef PJ1_PROFILE
+enum class Stage
 {
-	// quick calculation  
-	return (rgba.Red * 76 + rgba.Green * 150 + rgba.Blue * 30) >> 8;
-}
+	Load,
+	Gray,
+	Blur,
+	Scale,
+	NCC,
+	Output,
+	Count
+};
 
-void DrawRectangle(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+// the counters of one thread, a counter the kernel or the CPU does not allow is left out
+class PerfCounters
 {
-	// cache
-	unsigned int image_width = image_bmp->GetWidth();
-	unsigned int image_height = image_bmp->GetHeight();
+public:
+	static constexpr int count = 5;
+	static constexpr const char* names[count] = {"cycles", "instructions", "L1D misses", "LLC misses", "branch misses"};
 
-	// Y-axis
-	for (unsigned int i = y; i < y + height; ++i)
-	{
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x].Red = 0;
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x].Green = 255;
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x].Blue = 0;
+	PerfCounters();
+	~PerfCounters();
 
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x + width - 1].Red = 0;
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x + width - 1].Green = 255;
-        image_bmp->m_BitmapData[(image_height - i - 1) * image_width + x + width - 1].Blue = 0;
-	}
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
 
-	// X-axis
-	for (unsigned int i = x; i < x + width; ++i)
-	{
-        image_bmp->m_BitmapData[(image_height - y - 1) * image_width + i].Red = 0;
-        image_bmp->m_BitmapData[(image_height - y - 1) * image_width + i].Green = 255;
-        image_bmp->m_BitmapData[(image_height - y - 1) * image_width + i].Blue = 0;
+	// the counters not open stay 0
+	void Read(uint64_t values[count]) const;
 
-        image_bmp->m_BitmapData[(image_height - y - height) * image_width + i].Red = 0;
-        image_bmp->m_BitmapData[(image_height - y - height) * image_width + i].Green = 255;
-        image_bmp->m_BitmapData[(image_height - y - height) * image_width + i].Blue = 0;
+	static PerfCounters& ThisThread()
+	{
+		thread_local PerfCounters counters;
+		return counters;
 	}
 
-}
-
-void GenerateGaryscaleImage(CBitmap* bmp, uint8_t* gray_buffer)
-{
-	for (unsigned int i = 0; i < bmp->GetSize(); ++i)
+	// whether any thread could open counter k
+	static bool Available(int k)
 	{
-        bmp->m_BitmapData[i].Red = gray_buffer[i];
-        bmp->m_BitmapData[i].Green = gray_buffer[i];
-        bmp->m_BitmapData[i].Blue = gray_buffer[i];
+		return available[k];
 	}
 
-}
-
+private:
+	int leader = -1;
+	std::vector<int> fds;
+	std::vector<int> slots;   // the counter of every fd
+	static inline std::atomic<bool> available[count];
+};
 
-// change the m_BitmapData property. should call this function before get gray buffer
-void GaussianFilter(CBitmap* bmp)
+struct STAGETOTALS
 {
-	// one dimension gaussian kernel
-	float weight[] = {0.4026f, 0.2442f, 0.0545f};
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> nanoseconds;
+	std::atomic<uint64_t> counters[PerfCounters::count];
+};
 
-	// instantiate the matrix
-	matrix<RGBA> pixels(bmp->GetHeight() + 4, bmp->GetWidth() + 4);
+static STAGETOTALS stage_totals[static_cast<int>(Stage::Count)];
 
-	for (unsigned int i = 2; i < bmp->GetHeight() + 2; ++i)
+class StageScope
+{
+public:
+	explicit StageScope(Stage stage) : stage(stage), counters(PerfCounters::ThisThread())
 	{
-		for (unsigned int j = 2; j < bmp->GetWidth() + 2; ++j)
-		{
-			unsigned int index = (bmp->GetHeight() - i + 1) * bmp->GetWidth() + j - 2;
-			pixels[i][j] = bmp->m_BitmapData[index];			
-		}
+		counters.Read(begin_values);
+		begin = std::chrono::steady_clock::now();
 	}
 
-	// convonlution
-	// X-axis
-	for (unsigned int i = 2; i < bmp->GetHeight() + 2; ++i)
+	~StageScope()
 	{
-		for (unsigned int j = 2; j < bmp->GetWidth() + 2; ++j)
-		{
-			float sumR = pixels[i][j].Red * weight[0];
-			float sumG = pixels[i][j].Green * weight[0];
-			float sumB = pixels[i][j].Blue * weight[0];
-
-			for (unsigned int m = 1; m < 3; ++m)
-			{
-				sumR += pixels[i][j + m].Red * weight[m];
-				sumG += pixels[i][j + m].Green * weight[m];
-				sumB += pixels[i][j + m].Blue * weight[m];
+		auto end = std::chrono::steady_clock::now();
+		uint64_t end_values[PerfCounters::count];
+		counters.Read(end_values);
+
+		auto& totals = stage_totals[static_cast<int>(stage)];
+		totals.calls += 1;
+		totals.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+		for (int k = 0; k < PerfCounters::count; ++k)
+			totals.counters[k] += end_values[k] - begin_values[k];
+	}
 
-				sumR += pixels[i][j - m].Red * weight[m];
-				sumG += pixels[i][j - m].Green * weight[m];
-				sumB += pixels[i][j - m].Blue * weight[m];
-			}
+	StageScope(const StageScope&) = delete;
+	StageScope& operator=(const StageScope&) = delete;
 
-			pixels[i][j].Red = sumR;
-			pixels[i][j].Green = sumG;
-			pixels[i][j].Blue = sumB;
-		}
-	}
-	// Y-axis
-	for (unsigned int i = 2; i < bmp->GetHeight() + 2; ++i)
-	{
-		for (unsigned int j = 2; j < bmp->GetWidth() + 2; ++j)
-		{
-			float sumR = pixels[i][j].Red * weight[0];
-			float sumG = pixels[i][j].Green * weight[0];
-			float sumB = pixels[i][j].Blue * weight[0];
+private:
+	Stage stage;
+	const PerfCounters& counters;
+	std::chrono::steady_clock::time_point begin;
+	uint64_t begin_values[PerfCounters::count];
+};
 
-			for (unsigned int m = 1; m < 3; ++m)
-			{
-				sumR += pixels[i + m][j].Red * weight[m];
-				sumG += pixels[i + m][j].Green * weight[m];
-				sumB += pixels[i + m][j].Blue * weight[m];
+void PrintStageReport(std::ostream& out);
 
-				sumR += pixels[i - m][j].Red * weight[m];
-				sumG += pixels[i - m][j].Green * weight[m];
-				sumB += pixels[i - m][j].Blue * weight[m];
-			}
+#define PJ1_STAGE_REPORT_AT_EXIT() std::atexit([] { PrintStageReport(std::clog); })
+#else
+#define PJ1_STAGE_REPORT_AT_EXIT()
+#endif
 
-			pixels[i][j].Red = sumR;
-			pixels[i][j].Green = sumG;
-			pixels[i][j].Blue = sumB;
-		}
-	}
+// begin and end events for the Chrome trace viewer (chrome://tracing or ui.perfetto.dev). every thread
+// writes into its own ring buffer without locks, the oldest events are overwritten when it is full. the
+// buffers are only read when the trace file is written at exit, after the other threads are gone. a
+// scope costs one relaxed load while tracing is off.
+class Tracer
+{
+public:
+	// turns tracing on and writes filename at exit
+	static void Start(const std::string& filename);
 
-	// write back to the bitmap
-	for (unsigned int i = 2; i < bmp->GetHeight() + 2; ++i)
+	static bool Enabled()
 	{
-		for (unsigned int j = 2; j < bmp->GetWidth() + 2; ++j)
-		{
-			unsigned int index = (bmp->GetHeight() - i + 1) * bmp->GetWidth() + j - 2;
-			bmp->m_BitmapData[index] = pixels[i][j];		
-		}
+		return enabled.load(std::memory_order_relaxed);
 	}
 
-}
+	// name must outlive the program, e.g. a string literal
+	static void Record(const char* name, char phase);
 
-void GaussianFilterNTimes(CBitmap* bmp, unsigned int times)
-{
-	for (int i = 0; i < times; ++i)
+private:
+	struct EVENT
 	{
-		GaussianFilter(bmp);
-	}
-}
+		uint64_t time;   // ns since Start
+		const char* name;
+		char phase;      // 'B' or 'E'
+	};
 
+	struct Buffer
+	{
+		static constexpr uint64_t capacity = 1 << 16;
+		EVENT events[capacity];
+		std::atomic<uint64_t> head = 0;
+		unsigned int tid;
+		Buffer* next;
+	};
+
+	static Buffer& ThisThread();
+	static void Write();
+
+	static inline std::atomic<bool> enabled;
+	static inline std::atomic<Buffer*> buffers;
+	static inline std::atomic<unsigned int> threads;
+	static inline std::string filename;
+	static inline std::chrono::steady_clock::time_point start;
+};
+
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : name(Tracer::Enabled() ? name : nullptr)
+	{
+		if (this->name)
+			Tracer::Record(this->name, 'B');
+	}
+
+	~TraceScope()
+	{
+		if (name)
+			Tracer::Record(name, 'E');
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* name;
+};
+
+// PJ1_STAGE(Name); traces the rest of the block and, with PJ1_PROFILE, counts it in the stage report.
+// PJ1_TRACE("name"); only traces, these may enclose stages.
+#define PJ1_CONCAT_(a, b) a##b
+#define PJ1_CONCAT(a, b) PJ1_CONCAT_(a, b)
+#define PJ1_TRACE(name) TraceScope PJ1_CONCAT(trace_scope_, __LINE__)(name)
+#ifdef PJ1_PROFILE
+#define PJ1_STAGE(name) PJ1_TRACE(#name); StageScope PJ1_CONCAT(stage_scope_, __LINE__)(Stage::name)
+#else
+#define PJ1_STAGE(name) PJ1_TRACE(#name)
+#endif
+
+// output format for this project
+struct OUTPUTFORMAT
+{
+	unsigned int x;
+	unsigned int y;
+	float accuracy;
+	float IoU;
+
+	// not for output
+	unsigned int templ_scaled_width;
+	unsigned int templ_scaled_height;
+};
+
+// how the image is smoothed before it is scaled down
+enum class BlurMode
+{
+	Gaussian,   // the 5-tap kernel blur_passes times, the same for every scale
+	Box,        // blur_passes box filters approximating the anti-aliasing gaussian of each scale
+	Pyramid     // binomial half-band levels, see ScaleCache
+};
+
+// where the NCC gets the mean and the standard deviation of every image window from
+enum class StatsMode
+{
+	Integral,   // 64-bit summed-area tables, W x H memory
+	Running     // column sums of the current band of template rows slid along the row, W memory
+};
+
+// which NCC values above the threshold become candidates. the map is never stored, the peaks are found
+// while it is computed from a rolling window of three NCC rows.
+enum class PeakMode
+{
+	Threshold,  // every value above the threshold
+	LocalMax    // only values that are also the maximum of their 3x3 neighbourhood
+};
+
+// the order the scale hypotheses are searched in
+enum class ScaleOrder
+{
+	Fixed,      // widths from large to small, heights from small to large
+	Likely      // best first by how clear the NCC peak of half size thumbnails is, see RankHypotheses
+};
+
+// a candidate position in the NCC map
+struct PEAK
+{
+	unsigned int x;
+	unsigned int y;
+	float ncc;
+};
+
+// when the scale search ends before every hypothesis is searched
+enum class StopMode
+{
+	None,       // never, every scale is searched
+	Accuracy,   // pj1 only: the best match overlaps the ground truth by stop_accuracy
+	Confidence  // the NCC map of a scale has one clear peak, see Confident
+};
+
+// the shape of one NCC map, what the confidence stop looks at
+struct NCCSUMMARY
+{
+	PEAK best;        // the maximum of the map
+	float second;     // the best value at least a template away from it, an upper bound
+	float mean;
+	float deviation;  // standard deviation of the whole map
+};
+
+// how the NCC maps are stored in the heatmap file, see HeatmapWriter
+enum class HeatmapFormat
+{
+	None,       // no heatmap file
+	Float16,    // IEEE half floats
+	UInt8       // round((ncc + 1) * 127.5), so ncc = value / 127.5 - 1
+};
+
+// the NCC map of one scale on its way to the heatmap file
+struct HEATMAP
+{
+	float scale_width;
+	float scale_height;
+	unsigned int width;
+	unsigned int height;
+	HeatmapFormat format;
+	std::vector<uint8_t> data;
+
+	unsigned int SampleSize() const
+	{
+		return format == HeatmapFormat::Float16 ? 2 : 1;
+	}
+
+	uint8_t* Row(unsigned int i)
+	{
+		return data.data() + static_cast<size_t>(i) * width * SampleSize();
+	}
+};
+
+// what ResultSink writes
+enum class ResultFormat
+{
+	Text,       // the legacy output.txt
+	CSV,        // output.csv, one row per match
+	JSONL       // output.jsonl, one object per image
+};
+
+// a rectangle in source image coordinates
+struct BOX
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+// a match found without looking at the ground truth
+struct DETECTION
+{
+	BOX box;
+	float ncc;
+};
+
+// the matches of one image
+struct RESULT
+{
+	std::string image_name;
+	std::vector<OUTPUTFORMAT> matches;   // best first, at most MATCHCONFIG::matches
+	double time;                         // ms
+	bool complete = true;                // false if the deadline cut the scale search short
+};
+
+// search parameters, set by command line options or a --config file of them
+struct MATCHCONFIG
+{
+	float scale_min = 0.05f;     // scales searched on each axis, from min to max in steps of step
+	float scale_max = 0.15f;
+	float scale_step = 0.05f;
+	bool scale_auto = false;     // range and step from the template and image sizes instead, see AxisScales
+	unsigned int min_object = 0; // auto: smallest object side in the image worth searching for, 0 for the template side
+	unsigned int max_scales = 8; // auto: scales per axis at most, the larger objects are left out
+	ScaleOrder order = ScaleOrder::Likely;
+	float threshold = 0.6f;      // NCC a candidate needs
+	StopMode stop = StopMode::Confidence;
+	float stop_accuracy = 0.8f;  // StopMode::Accuracy: accuracy of the best match
+	float stop_ncc = 0.9f;       // StopMode::Confidence: NCC of the best peak,
+	float stop_margin = 0.1f;    // how far it is above every value a template away from it,
+	float stop_sharpness = 4.0f; // and how many standard deviations of the map it is above its mean
+	unsigned int matches = 5;    // matches pj1 keeps per image
+	double deadline = 0.0;       // ms per image from loading on, the best match so far is kept then. 0 for none
+	BlurMode blur = BlurMode::Gaussian;
+	unsigned int blur_passes = 3;
+	StatsMode stats = StatsMode::Integral;
+	PeakMode peaks = PeakMode::Threshold;
+	unsigned int threads = 0;   // 0 uses every core
+	bool affinity = false;      // pin NCC worker t to logical CPU t
+	HeatmapFormat heatmap = HeatmapFormat::None;
+	ResultFormat output = ResultFormat::Text;
+	std::string trace;          // Chrome trace file written at exit, none if empty
+	unsigned int cache = 0;     // results kept for repeated frames, see ResultCache. 0 for no cache
+	bool incremental = false;   // update the NCC maps of the last frame, see NCCWorkers::Update
+};
+
+// one (scaleWidth, scaleHeight) pair of the scale search. the image is scaled by it, the template is not.
+struct HYPOTHESIS
+{
+	float scale_width;
+	float scale_height;
+};
+
+class NCCWorkers;
+
+// scaled gray copies of one image, shared by every hypothesis of the scale search.
+// scaling is separable: everything along the X-axis only depends on scale_width, so it runs once per
+// scale_width and its result, full height but already narrow, is kept. every scale_height is then made
+// from it along the Y-axis only.
+// with BlurMode::Pyramid the image is halved along the X-axis with the binomial kernel first and the
+// nearest scaling starts from the smallest level that is still at least as wide, the same happens along
+// the Y-axis on the narrow image. each axis keeps its levels in one Pyramid. BlurMode::Gaussian blurs the full image once, BlurMode::Box runs its
+// X-axis and Y-axis box filters with the two steps.
+class ScaleCache
+{
+public:
+	// BlurMode::Gaussian runs on workers if there are any
+	void Build(ImageView<const uint8_t> gray, const MATCHCONFIG& config, const std::vector<HYPOTHESIS>& hypotheses, NCCWorkers* workers = nullptr, bool thumbnails = false);
+
+	// dst is resized to the scaled size of the image
+	void Resample(float scale_width, float scale_height, Image<uint8_t>& dst);
+
+	// the same at half of both scales, a HalfLength() of the size of Resample. only with thumbnails in Build,
+	// they are made from the smallest level of one pyramid of the image that is still large enough, so a
+	// thumbnail costs no more than its own pixels
+	void Thumbnail(float scale_width, float scale_height, Image<uint8_t>& dst);
+
+	// of the image before scaling
+	unsigned int Width() const { return width; }
+	unsigned int Height() const { return height; }
+
+private:
+	// the image after the X-axis steps of one scale_width
+	struct Columns
+	{
+		float scale_width;
+		Pyramid rows;   // level b is the scaled image halved b times along the Y-axis, only BlurMode::Pyramid has more than level 0
+	};
+
+	static unsigned int Octave(float scale);
+	Columns& ForWidth(float scale_width);
+
+	unsigned int width = 0;
+	unsigned int height = 0;
+	BlurMode blur = BlurMode::Gaussian;
+	unsigned int blur_passes = 0;
+	unsigned int row_octaves = 0;   // Y-axis halvings the scale heights need
+	Pyramid levels;   // level a is the base halved a times along the X-axis
+	Pyramid thumbnails;   // the image halved along both axes
+	std::vector<Columns> columns;
+	Image<uint8_t> scratch;
+};
+
+// summed-area tables of the pixels and of the squared pixels. they are one row and one column larger
+// than the image, the first row and column are zero.
+class IntegralImage
+{
+public:
+	void Build(ImageView<const uint8_t> image);
+
+	// the same after only the rows from first_row on changed since the last Build or Update of an image of
+	// this size, the tables above first_row stay as they are. a new size is built from scratch.
+	void Update(ImageView<const uint8_t> image, unsigned int first_row);
+
+	// sum and squared sum of the w x h window whose top left corner is (x, y)
+	void Window(unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint64_t& sum, uint64_t& sqsum) const
+	{
+		auto s = this->sum.View();
+		auto q = this->sqsum.View();
+		sum = s[y + h][x + w] - s[y][x + w] - s[y + h][x] + s[y][x];
+		sqsum = q[y + h][x + w] - q[y][x + w] - q[y + h][x] + q[y][x];
+	}
+
+private:
+	void Rows(ImageView<const uint8_t> image, unsigned int first_row);
+
+	Image<uint64_t> sum;
+	Image<uint64_t> sqsum;
+};
+
+// sum and squared sum of every template sized window, one row of NCC positions at a time. reads them from
+// an IntegralImage, or without one keeps the column sums of the template rows of the current band: moving
+// down a row subtracts the departing image row and adds the incoming one, moving right adds a column
+// sum and subtracts one. O(1) per window either way, the running sums only need O(W) memory.
+class WindowStats
+{
+public:
+	WindowStats(ImageView<const uint8_t> image, const IntegralImage* integral, unsigned int templ_width, unsigned int templ_height);
+
+	// any row can be asked for, the running sums are cheapest when the rows come in increasing order
+	void Row(unsigned int i, uint64_t* sum, uint64_t* sqsum);
+
+private:
+	ImageView<const uint8_t> image;
+	const IntegralImage* integral;
+	unsigned int templ_width;
+	unsigned int templ_height;
+	unsigned int band = 0;   // the first image row in the column sums
+	bool valid = false;
+	std::vector<uint32_t> column_sum;
+	std::vector<uint32_t> column_sqsum;
+};
+
+// the template with its mean removed and its standard deviation, the same for every position and scale
+class TemplateStats
+{
+public:
+	void Build(ImageView<const uint8_t> templ);
+
+	ImageView<const float> Centered() const
+	{
+		return centered.View();
+	}
+
+	float StandardDeviation() const
+	{
+		return standard_deviation;
+	}
+
+private:
+	Image<float> centered;
+	float standard_deviation = 0.0f;
+};
+
+// the NCC map of image one row at a time, a row is image.width - templ.width + 1 wide. no integral image for
+// StatsMode::Running
+class NCCRows
+{
+public:
+	NCCRows(ImageView<const uint8_t> image, const IntegralImage* integral, const TemplateStats& templ);
+
+	unsigned int Width() const
+	{
+		return width;
+	}
+
+	// row i of the map into ncc, the rows are cheapest in increasing order
+	void Row(unsigned int i, float* ncc)
+	{
+		Row(i, ncc, 0, width);
+	}
+
+	// only the columns from begin to end of it, several spans of one row share its window statistics
+	void Row(unsigned int i, float* ncc, unsigned int begin, unsigned int end);
+
+private:
+	ImageView<const uint8_t> image;
+	const TemplateStats& templ;
+	WindowStats stats;
+	unsigned int width;
+	unsigned int row = std::numeric_limits<unsigned int>::max();   // the row of sums and sqsums
+	std::vector<uint64_t> sums;
+	std::vector<uint64_t> sqsums;
+};
+
+// what the incremental mode keeps of the last frame at one scale, see NCCWorkers::Update
+struct FRAMEMAP
+{
+	Image<uint8_t> scaled;    // the scaled image the map was computed from
+	IntegralImage integral;   // of scaled
+	Image<float> ncc;         // the whole NCC map
+	bool valid = false;       // the last search of this scale completed
+};
+
+// the FRAMEMAP of every scale hypothesis of one stream of frames, e.g. one camera. a new template
+// forgets them all, a new image size invalidates them in NCCWorkers::Update.
+class FrameMaps
+{
+public:
+	// before the maps of a frame are looked up
+	void SetTemplate(ImageView<const uint8_t> templ_gray);
+
+	FRAMEMAP& Find(const HYPOTHESIS& hypothesis)
+	{
+		return maps[{hypothesis.scale_width, hypothesis.scale_height}];
+	}
+
+private:
+	uint64_t templ = 0;   // PixelHash of the template rows
+	std::map<std::pair<float, float>, FRAMEMAP> maps;
+};
+
+// worker threads for the NCC that live as long as the matcher. the output rows are split into one tile
+// per worker, and every worker streams its tile through a window of three NCC rows into a list of peaks.
+// the scratch memory (the integral image of the image rows of the tile, the row window and the peaks) is
+// kept from one scale to the next, and the worker allocates and first touches it itself, so on NUMA
+// machines the pages end up on the node of the thread that uses them. with affinity the workers are
+// pinned, so they also stay there.
+class NCCWorkers
+{
+public:
+	NCCWorkers(unsigned int threads, bool affinity);
+	~NCCWorkers();
+
+	NCCWorkers(const NCCWorkers&) = delete;
+	NCCWorkers& operator=(const NCCWorkers&) = delete;
+
+	// the peaks of the NCC map of image above threshold, returns when every tile is done.
+	// with a heatmap the whole map is also encoded into it, it must already have the size of the map.
+	// at the deadline every tile stops after its current rows and false is returned, the peaks of the rows
+	// that were done are kept.
+	bool Run(ImageView<const uint8_t> image, const TemplateStats& templ, StatsMode stats, PeakMode peaks, float threshold, HEATMAP* heatmap = nullptr,
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+	// Run for the next frame of a stream. image is compared with frame.scaled in tiles of tile x tile pixels,
+	// the integral image is updated from the first changed row on and only the NCC values whose windows
+	// overlap a changed tile are computed again, the rest of frame.ncc is reused. the peaks then come from
+	// the whole map. frame keeps the image and the map for the next frame, the stats are always integral.
+	bool Update(ImageView<const uint8_t> image, const TemplateStats& templ, PeakMode peaks, float threshold, FRAMEMAP& frame, HEATMAP* heatmap = nullptr,
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+	static constexpr unsigned int tile = 16;
+
+	unsigned int Tiles() const
+	{
+		return static_cast<unsigned int>(workers.size());
+	}
+
+	// the peaks of tile t in row-major order, the tiles follow each other down the map
+	const std::vector<PEAK>& Peaks(unsigned int t) const
+	{
+		return workers[t].peaks;
+	}
+
+	// task(t) on every worker t, returns when all of them are done. for work besides the NCC that should not
+	// start threads of its own, e.g. the bands of GaussianFilter()
+	void Each(const std::function<void(unsigned int)>& task);
+
+	// the map of the last Run, gathered while it was computed. after the deadline only the rows that were
+	// done count, the mean and the deviation too. the second peak only knows the peaks above the threshold
+	// and the maximum of every tile.
+	NCCSUMMARY Summary() const;
+
+private:
+	struct Worker
+	{
+		std::thread thread;
+		IntegralImage integral;
+		Image<float> window;
+		std::vector<PEAK> peaks;
+		PEAK best;       // the maximum of the rows of this tile
+		double sum;      // and the sum and the squared sum of their values
+		double sqsum;
+		double count;    // and how many there are, fewer than the tile has when the deadline cut it short
+		bool complete;   // every row of the tile was done before the deadline
+		unsigned int refreshed;        // Update: the rows of the tile before it are up to date
+		std::vector<uint8_t> columns;  // Update: the changed tile columns under the windows of one row
+	};
+
+	// Run computes every row, Update refreshes the changed parts of the map and then scans all of it, Each
+	// runs task
+	enum class Job {Full, Refresh, Scan, Task};
+
+	bool Dispatch();   // the current job on every worker, false if a tile missed the deadline
+	void Loop(unsigned int t, bool affinity);
+	void Compute(unsigned int t);
+	void Refresh(unsigned int t);
+	void Scan(unsigned int t);
+	void Tally(Worker& worker, const float* row, unsigned int cols, unsigned int y);
+
+	std::vector<Worker> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	unsigned int generation = 0;
+	unsigned int pending = 0;
+	bool stop = false;
+
+	// the current job
+	ImageView<const uint8_t> image;
+	const TemplateStats* templ = nullptr;
+	StatsMode stats = StatsMode::Integral;
+	PeakMode peak_mode = PeakMode::Threshold;
+	float threshold = 0.0f;
+	HEATMAP* heatmap = nullptr;
+	std::chrono::steady_clock::time_point deadline;
+	Job job = Job::Full;
+	FRAMEMAP* frame = nullptr;
+	const std::function<void(unsigned int)>* task = nullptr;
+	std::vector<uint8_t> dirty;   // Update: the changed tiles of image in row-major order
+	unsigned int tiles_x = 0;
+};
+
+// writes the NCC maps of every scale into one file on its own thread, so the matcher never waits for the
+// disk. the layout is made for memory mapping, every number is little endian:
+//   file header, 64 bytes: "NCCH", uint32 version = 1, uint32 format (1 float16, 2 uint8), uint32 maps
+//   every map, 64-byte aligned: a 64-byte header of float scale_width, float scale_height, uint32 width,
+//   uint32 height, then width x height samples in row-major order, padded to 64 bytes
+class HeatmapWriter
+{
+public:
+	HeatmapWriter(const std::string& filename, HeatmapFormat format);
+	~HeatmapWriter();   // writes what is still queued and the map count
+
+	HeatmapWriter(const HeatmapWriter&) = delete;
+	HeatmapWriter& operator=(const HeatmapWriter&) = delete;
+
+	bool IsOpen() const
+	{
+		return file.is_open();
+	}
+
+	void Write(HEATMAP heatmap);
+
+private:
+	void Loop();
+
+	std::ofstream file;
+	HeatmapFormat format;
+	uint32_t maps = 0;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<HEATMAP> queue;
+	bool stop = false;
+};
+
+// what a cached result was computed from
+struct CACHEKEY
+{
+	uint64_t image;    // CBitmap::GetPixelHash
+	uint64_t templ;
+	uint64_t config;   // ConfigHash
+	uint64_t query;    // whatever else the result depends on, e.g. the detections pj1_evaluate asks for
+
+	bool operator==(const CACHEKEY&) const = default;
+};
+
+// the results of the last capacity keys, so that byte-identical frames skip the search. safe to share
+// between threads, the least recently used result is dropped first.
+template <typename Value>
+class ResultCache
+{
+public:
+	explicit ResultCache(size_t capacity) : capacity(capacity)
+	{
+	}
+
+	std::optional<Value> Find(const CACHEKEY& key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = index.find(key);
+		if (found == index.end())
+			return std::nullopt;
+		entries.splice(entries.begin(), entries, found->second);
+		return found->second->second;
+	}
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		index.clear();
+		entries.clear();
+	}
+
+	void Insert(const CACHEKEY& key, Value value)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = index.find(key);
+		if (found != index.end())
+		{
+			found->second->second = std::move(value);
+			entries.splice(entries.begin(), entries, found->second);
+			return;
+		}
+
+		entries.emplace_front(key, std::move(value));
+		index[key] = entries.begin();
+		if (entries.size() > capacity)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+	}
+
+private:
+	struct KeyHash
+	{
+		size_t operator()(const CACHEKEY& key) const
+		{
+			return static_cast<size_t>(key.image ^ std::rotl(key.templ, 17) ^ std::rotl(key.config, 31) ^ std::rotl(key.query, 47));
+		}
+	};
+
+	size_t capacity;
+	std::mutex mutex;
+	std::list<std::pair<CACHEKEY, Value>> entries;   // the most recently used first
+	std::unordered_map<CACHEKEY, typename std::list<std::pair<CACHEKEY, Value>>::iterator, KeyHash> index;
+};
+
+// collects the results of every job and writes them from a single thread. submitting never takes a lock,
+// the results go onto a lock-free list the writer empties in one exchange. the writer holds back results
+// that arrive early, so the file always lists them in job order, and writes each run of them with one
+// buffered write.
+class ResultSink
+{
+public:
+	explicit ResultSink(ResultFormat format);
+	~ResultSink();   // writes everything that is still held back
+
+	ResultSink(const ResultSink&) = delete;
+	ResultSink& operator=(const ResultSink&) = delete;
+
+	// every job number from 0 up must be submitted once, nothing is written for a skipped job
+	void Submit(size_t job, RESULT result);
+	void Skip(size_t job);
+
+private:
+	struct Node
+	{
+		size_t job;
+		std::optional<RESULT> result;
+		bool last;   // pushed by the destructor
+		Node* next;
+	};
+
+	void Push(Node* node);
+	void Loop();
+	void Format(const RESULT& result, std::string& out) const;
+
+	ResultFormat format;
+	std::ofstream file;
+	std::atomic<Node*> head = nullptr;
+	std::thread thread;
+};
+
+// function declaration
+// every stage reads from src and writes to dst explicitly, the caller owns both buffers.
+uint8_t R8G8B8A82GR(RGBA rgba);
+void DrawRectangle(ImageView<uint8_t> rgba, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void GenerateGaryscaleImage(ImageView<const uint8_t> gray, ImageView<uint8_t> rgba);
+void ConvertToGrayscale(ImageView<const uint8_t> rgba, ImageView<uint8_t> gray);
+void CopyImage(ImageView<const uint8_t> src, ImageView<uint8_t> dst);
+unsigned int WorkerCount(unsigned int requested);
+void PinCurrentThread(unsigned int cpu);
+void GaussianFilter(ImageView<const uint8_t> src, ImageView<uint8_t> dst, NCCWorkers* workers = nullptr);                              // dst may alias src
+void GaussianFilterNTimes(ImageView<const uint8_t> src, ImageView<uint8_t> dst, unsigned int times, NCCWorkers* workers = nullptr);    // same as above
+std::vector<unsigned int> BoxRadiiForGauss(float sigma, unsigned int passes);
+float AntiAliasSigma(float scale);
+void BoxFilter(ImageView<const uint8_t> src, ImageView<uint8_t> dst, unsigned int radius_x, unsigned int radius_y);
+void BoxBlur(ImageView<const uint8_t> src, ImageView<uint8_t> dst, float sigma_x, float sigma_y, unsigned int passes);
+unsigned int HalfLength(unsigned int length);
+void PyrDown(ImageView<const uint8_t> src, ImageView<uint8_t> dst, bool halve_x = true, bool halve_y = true);   // gray only, the halved axes of dst are HalfLength() of src
+unsigned int ScaledLength(unsigned int length, float scale);
+std::vector<unsigned int> NearestIndexTable(unsigned int dst_length, unsigned int src_length, float scale);
+void NearestScaling(ImageView<const uint8_t> src, ImageView<uint8_t> dst, const std::vector<unsigned int>& src_rows, const std::vector<unsigned int>& src_cols);
+void NearestScaling(ImageView<const uint8_t> src, ImageView<uint8_t> dst, float scaleWidth, float scaleHeight);
+void FindPeaks(const float* above, const float* row, const float* below, unsigned int width, unsigned int y, PeakMode mode, float threshold, std::vector<PEAK>& peaks);   // above and below may be nullptr
+uint16_t FloatToHalf(float value);
+void EncodeHeatmapRow(const float* ncc, unsigned int width, HeatmapFormat format, uint8_t* dst);
+bool DescendingWithAccuracy(OUTPUTFORMAT a, OUTPUTFORMAT b);
+bool Confident(const NCCSUMMARY& summary, const MATCHCONFIG& config);   // the one clear peak of StopMode::Confidence
+int Clamp(int x, int min, int max);
+std::vector<HYPOTHESIS> ScaleHypotheses(const MATCHCONFIG& config, unsigned int image_width, unsigned int image_height, unsigned int templ_width, unsigned int templ_height);
+template <typename T>
+bool ParseNumber(const std::string& text, T& value, T min, T max);   // false unless all of text is a number from min to max
+bool ParseOption(const std::string& arg, MATCHCONFIG& config);   // false if arg is not a MATCHCONFIG option or its value is bad
+void OptionError(const std::string& arg, const std::string& where = "");
+bool LoadConfig(const std::string& filename, MATCHCONFIG& config);
+uint64_t ConfigHash(const MATCHCONFIG& config);   // of the options that change results
+float IoU(const BOX& a, const BOX& b);
+BOX SourceBox(const HYPOTHESIS& hypothesis, const PEAK& peak, unsigned int image_width, unsigned int image_height, unsigned int templ_width, unsigned int templ_height);
+std::chrono::steady_clock::time_point Deadline(std::chrono::steady_clock::time_point begin, const MATCHCONFIG& config);
+std::vector<DETECTION> DetectTemplate(ImageView<const uint8_t> image_gray, ImageView<const uint8_t> templ_gray, const MATCHCONFIG& config, NCCWorkers& workers, FrameMaps* frames, unsigned int top, std::chrono::steady_clock::time_point deadline, bool& complete);   // complete is false after the deadline
+double Percentile(const std::vector<double>& sorted, double p);
+void TemplateMatching(int num, ResultSink& results, size_t job, bool save = false);
+int Evaluate(int argc, char** argv);
+int Generate(int argc, char** argv);
+
+// global varibles
+static std::unique_ptr<CBitmap> image_bmp;
+static std::shared_ptr<const CBitmap> templ_bmp;
+static std::string image_name;
+static std::string templ_name;
+static MATCHCONFIG config;
+
+// ground truth
+struct coordinates
+{
+	unsigned int x;
+	unsigned int y;
+};
+
+// match manually
+static coordinates ground_truth[101] = 
+{{537, 420}, {782, 392}, {562, 375}, {1000, 232}, {456, 396},
+ {331, 388}, {1070, 390}, {432, 362}, {992, 440}, {451, 408},
+{1, 289}, {1424, 375}, {1281, 398}, {558, 317}, {1413, 400},
+{486, 331}, {773, 333}, {320, 358}, {538, 368}, {353, 315},
+{1118, 361}, {317, 586}, {363, 576}, {4, 598}, {196, 420},
+{513, 348}, {1378, 409}, {430, 526}, {935, 319}, {789, 411},
+{1175, 385}, {653, 410}, {642, 364}, {845, 330}, {1216, 349},
+{350, 414}, {134, 340}, {362, 347}, {1127, 331}, {1138, 470},
+{666, 364}, {242, 223}, {612, 443}, {208, 381}, {1313, 333},
+{1088, 369}, {321, 270}, {1640, 391},{914, 364}, {3, 363},
+{1092, 238}, {794, 398}, {20, 355}, {1071, 311}, {118, 345},
+{1076, 219},{540, 288}, {639, 379}, {829, 262}, {56, 293},
+{1092, 370}, {586, 463}, {857, 408}, {1113, 461}, {940, 481},
+{191, 263}, {530, 359}, {1127, 327}, {1140, 355}, {420, 465},
+{395, 464}, {719, 1}, {733, 651}, {946, 495}, {571, 434},
+{738, 293}, {980, 145}, {797, 591}, {855, 1}, {357, 263},
+{718, 276}, {244, 644}, {352, 273}, {1069, 548}, {473, 461},
+{66, 396}, {550, 160}, {198, 371}, {403, 374}, {428, 400},
+{672, 377}, {1038, 285}, {23, 344}, {8, 370}, {827, 368},
+{1050, 250}, {1122, 358}, {526, 380}, {692, 274}, {927, 214},
+{155, 317}};
+
+
+
+// the main function
+#if !defined(PJ1_EVALUATE) && !defined(PJ1_GENERATE)
+int main(int argc, char** argv){
+
+	// only for debug, you can just ignore it.
+	// output the basic .txt and a source image with bounding boxes.  
+	// some images cannot be output,(such as test002.bmp and test003.bmp), which is caused by the Save(const char*)  
+	// function in CBitmap class. And I am not going to fix it.
+	// e.g.  Terminal:
+	// D:pj1\build> .\pj1.exe 1
+	// it will automatically search for the test001.bmp and obj001.bmp, then output debug information.
+	//
+	// options can be put anywhere:
+	// --scales=MIN:MAX:STEP scales searched on each axis, 0.05:0.15:0.05 by default
+	// --scales=auto     scales from the template and image sizes, from --min-object up in steps of one
+	//                   template pixel
+	// --min-object=N    auto: smallest object side worth searching for, the template side by default
+	// --max-scales=N    auto: scales per axis at most, 8 by default. they are a template pixel apart, so the
+	//                   objects above about min-object * (1 + 1 / template side)^(N - 1) are not searched.
+	//                   the cost grows with the square
+	// --order=likely    search the scales best first by a thumbnail NCC, so the early exit comes sooner (default)
+	// --order=fixed     search the widths from large to small and the heights from small to large
+	// --threshold=F     NCC a candidate needs, 0.6 by default
+	// --stop=confidence stop the scale search at a scale whose NCC map has one clear peak, needs no ground truth
+	// --stop=accuracy   stop it once the best match overlaps the ground truth by --stop-accuracy (default)
+	// --stop=none       search every scale
+	// --stop-ncc=F      confidence: NCC of the best peak, 0.9 by default
+	// --stop-margin=F   confidence: over every NCC a template away from it, 0.1 by default
+	// --stop-sharpness=F confidence: standard deviations of the map above its mean, 4 by default
+	// --stop-accuracy=F accuracy: 0.8 by default
+	// --matches=N       matches kept per image, 5 by default
+	// --deadline=MS     give up the scale search MS after loading began and keep the best match so far. the
+	//                   ranking of --order=likely counts too, --order=fixed gets to the scales in its own order
+	// --blur-passes=N   gaussian or box filter passes, 3 by default
+	// --blur=gaussian   5-tap gaussian filter three times before scaling (default)
+	// --blur=box        box filters sized to the anti-aliasing gaussian of each scale
+	// --blur=pyramid    binomial half-band levels per axis, nearest scaling from the closest one
+	// --stats=integral  window statistics from summed-area tables (default)
+	// --stats=running   window statistics from running column sums, O(W) memory for very wide images
+	// --peaks=threshold every NCC value above the threshold is a candidate (default)
+	// --peaks=local-max only the 3x3 local maxima above the threshold are candidates
+	// --threads=N       worker threads, 0 uses every core (default)
+	// --affinity        pin every NCC worker thread to its own logical CPU
+	// --heatmap=f16     also write the NCC map of every scale to heatmap_<image>.ncc as half floats
+	// --heatmap=u8      the same quantized to bytes
+	// --output=text     append the results to output.txt (default)
+	// --output=csv      append one row per match to output.csv
+	// --output=jsonl    append one JSON object per image to output.jsonl
+	// --trace=FILE      write a Chrome trace of every stage on every thread to FILE at exit
+	// --config=FILE     read more of these options from FILE, one per line, # starts a comment
+	//
+	// built with PJ1_PROFILE the time and the hardware counters of every stage are printed at exit.
+	PJ1_STAGE_REPORT_AT_EXIT();
+
+	// the images of pj1 come with their ground truth
+	config.stop = StopMode::Accuracy;
+
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (ParseOption(arg, config))
+			continue;
+		if (arg.rfind("--", 0) == 0)
+		{
+			OptionError(arg);
+			return 1;
+		}
+		else
+			args.push_back(arg);
+	}
+
+	if (!config.trace.empty())
+		Tracer::Start(config.trace);
+	// one frame per run leaves nothing to update or to repeat
+	if (config.incremental)
+	{
+		std::cerr << "--incremental needs a stream of frames, see pj1_evaluate\n";
+		return 1;
+	}
+	if (config.cache > 0)
+	{
+		std::cerr << "--cache needs repeated frames, see pj1_evaluate\n";
+		return 1;
+	}
+
+	if (args.size() == 1)
+	{
+		int id = 0;
+		if (!ParseNumber(args[0], id, 1, 100)) return 0;
+
+		image_name = std::format("test{:03}.bmp", id);
+		templ_name = std::format("obj{:03}.bmp", id);
+
+		ResultSink results(config.output);
+		std::clog << "\rimages remaining: " << 1 << ' ' << std::flush;
+		TemplateMatching(id, results, 0, true);
+
+		return 0;
+	}
+
+	ResultSink results(config.output);
+
+	// match for input1.bmp
+	image_name = "input1.bmp";
+	templ_name = "input2.bmp";
+
+	std::clog << "\rimages remaining: " << 1 << ' ' << std::flush;
+	TemplateMatching(0, results, 0);
+
+
+	// match for test001.bmp ~ test100.bmp
+	
+	// for (int m = 1; m < 101; ++m)
+	// {
+	// 	std::clog << "\rimages remaining: " << 101 - m << ' ' << std::flush;
+	// 	image_name = std::format("test{:03}.bmp", m);
+	// 	templ_name = std::format("obj{:03}.bmp", m);
+
+	// 	TemplateMatching(m, results, m);	
+	// }
+
+	return 0;
+	
+}
+#elif defined(PJ1_EVALUATE)
+int main(int argc, char** argv)
+{
+	return Evaluate(argc, argv);
+}
+#else
+int main(int argc, char** argv)
+{
+	return Generate(argc, argv);
+}
+#endif
+
+
+uint8_t R8G8B8A82GR(RGBA rgba)
+{
+	// quick calculation
+	return (rgba.Red * 76 + rgba.Green * 150 + rgba.Blue * 30) >> 8;
+}
+
+void DrawRectangle(ImageView<uint8_t> rgba, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+	auto green = [&](unsigned int px, unsigned int py)
+	{
+		uint8_t* pixel = rgba[py] + px * rgba.channels;
+		pixel[0] = 0;
+		pixel[1] = 255;
+		pixel[2] = 0;
+	};
+
+	// Y-axis
+	for (unsigned int i = y; i < y + height; ++i)
+	{
+		green(x, i);
+		green(x + width - 1, i);
+	}
+
+	// X-axis
+	for (unsigned int i = x; i < x + width; ++i)
+	{
+		green(i, y);
+		green(i, y + height - 1);
+	}
+
+}
+
+void GenerateGaryscaleImage(ImageView<const uint8_t> gray, ImageView<uint8_t> rgba)
+{
+	for (unsigned int i = 0; i < gray.height; ++i)
+	{
+		const uint8_t* src = gray[i];
+		uint8_t* dst = rgba[i];
+		for (unsigned int j = 0; j < gray.width; ++j)
+		{
+			dst[j * 4] = src[j];
+			dst[j * 4 + 1] = src[j];
+			dst[j * 4 + 2] = src[j];
+		}
+	}
+
+}
+
+void ConvertToGrayscale(ImageView<const uint8_t> rgba, ImageView<uint8_t> gray)
+{
+	assert(rgba.channels == 4);
+
+	for (unsigned int i = 0; i < rgba.height; ++i)
+	{
+		auto src = reinterpret_cast<const RGBA*>(rgba[i]);
+		uint8_t* dst = gray[i];
+		for (unsigned int j = 0; j < rgba.width; ++j)
+			dst[j] = R8G8B8A82GR(src[j]);
+	}
+}
+
+void CopyImage(ImageView<const uint8_t> src, ImageView<uint8_t> dst)
+{
+	if (src.data == dst.data && src.stride == dst.stride) return;
+
+	for (unsigned int i = 0; i < src.height; ++i)
+		memcpy(dst[i], src[i], src.width * src.channels);
+}
+
+
+// one dimension gaussian kernel
+static const float gaussian_weight[] = {0.4026f, 0.2442f, 0.0545f};
+
+// X-axis of one row. the row is copied into a line with two replicated pixels on both sides, so the
+// border needs no special case.
+static void GaussianFilterRow(const uint8_t* src, uint8_t* dst, uint8_t* line, unsigned int width, unsigned int channels)
+{
+	unsigned int row_size = width * channels;
+	auto ch = static_cast<std::ptrdiff_t>(channels);
+
+	for (unsigned int c = 0; c < channels; ++c)
+	{
+		line[c] = line[channels + c] = src[c];
+		line[row_size + 2 * channels + c] = line[row_size + 3 * channels + c] = src[row_size - channels + c];
+	}
+	memcpy(line + 2 * channels, src, row_size);
+
+	const uint8_t* center = line + 2 * channels;
+	for (unsigned int k = 0; k < row_size; ++k)
+	{
+		const uint8_t* p = center + k;
+		float sum = p[0] * gaussian_weight[0];
+		sum += p[ch] * gaussian_weight[1];
+		sum += p[-ch] * gaussian_weight[1];
+		sum += p[2 * ch] * gaussian_weight[2];
+		sum += p[-2 * ch] * gaussian_weight[2];
+		dst[k] = static_cast<uint8_t>(sum);
+	}
+}
+
+// Y-axis of one row, rows[2] is the center row
+static void GaussianFilterColumns(const uint8_t* const rows[5], uint8_t* dst, unsigned int row_size)
+{
+	for (unsigned int k = 0; k < row_size; ++k)
+	{
+		float sum = rows[2][k] * gaussian_weight[0];
+		sum += rows[3][k] * gaussian_weight[1];
+		sum += rows[1][k] * gaussian_weight[1];
+		sum += rows[4][k] * gaussian_weight[2];
+		sum += rows[0][k] * gaussian_weight[2];
+		dst[k] = static_cast<uint8_t>(sum);
+	}
+}
+
+// 0 means one worker per core
+unsigned int WorkerCount(unsigned int requested)
+{
+	if (requested > 0) return requested;
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// best effort, a no-op where it is not supported
+void PinCurrentThread(unsigned int cpu)
+{
+	cpu %= WorkerCount(0);
+#if defined(_WIN32)
+	if (cpu < 8 * sizeof(DWORD_PTR))
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// separable 5x5 gaussian filter, the edge pixels are replicated.
+void GaussianFilter(ImageView<const uint8_t> src, ImageView<uint8_t> dst, NCCWorkers* workers)
+{
+	GaussianFilterNTimes(src, dst, 1, workers);
+}
+
+// the rows are split into one band per worker. every band filters its rows plus two halo rows above and
+// below along the X-axis into its own buffer, so its Y-axis pass needs nothing from the other bands and
+// the result is the same for any number of workers. the X-axis pass of every band ends before any Y-axis
+// pass writes dst, and the other way round, so dst may alias src and every pass after the first runs in
+// place. the buffers are made once for all passes and the bands run on the threads of the workers, without
+// workers on the calling thread.
+void GaussianFilterNTimes(ImageView<const uint8_t> src, ImageView<uint8_t> dst, unsigned int times, NCCWorkers* workers)
+{
+	if (times == 0)
+	{
+		CopyImage(src, dst);
+		return;
+	}
+
+	unsigned int width = src.width;
+	unsigned int height = src.height;
+	unsigned int channels = src.channels;
+
+	// bands thinner than this cost more in halo rows than they save
+	const unsigned int min_band_height = 32;
+	unsigned int bands = Clamp(workers ? workers->Tiles() : 1, 1, std::max(1u, height / min_band_height));
+
+	struct BAND
+	{
+		unsigned int begin;
+		unsigned int end;
+		unsigned int halo_begin;
+		unsigned int halo_end;
+		Image<uint8_t> horizontal;
+		std::vector<uint8_t> line;
+	};
+	std::vector<BAND> band(bands);
+	for (unsigned int t = 0; t < bands; ++t)
+	{
+		band[t].begin = height * t / bands;
+		band[t].end = height * (t + 1) / bands;
+		band[t].halo_begin = band[t].begin < 2 ? 0 : band[t].begin - 2;
+		band[t].halo_end = std::min(band[t].end + 2, height);
+		band[t].horizontal.Resize(width, band[t].halo_end - band[t].halo_begin, channels);
+		band[t].line.resize((width + 4) * channels);
+	}
+
+	auto each = [&](const std::function<void(unsigned int)>& task)
+	{
+		if (workers)
+			workers->Each(task);
+		else
+			task(0);
+	};
+
+	ImageView<const uint8_t> input = src;
+	for (unsigned int pass = 0; pass < times; ++pass, input = dst)
+	{
+		// X-axis into the buffer of the band
+		each([&](unsigned int t)
+		{
+			if (t >= bands)
+				return;
+			PJ1_STAGE(Blur);
+			BAND& b = band[t];
+			auto horizontal = b.horizontal.View();
+			for (unsigned int i = b.halo_begin; i < b.halo_end; ++i)
+				GaussianFilterRow(input[i], horizontal[i - b.halo_begin], b.line.data(), width, channels);
+		});
+
+		// Y-axis
+		each([&](unsigned int t)
+		{
+			if (t >= bands)
+				return;
+			PJ1_STAGE(Blur);
+			BAND& b = band[t];
+			auto horizontal = b.horizontal.View();
+			for (unsigned int i = b.begin; i < b.end; ++i)
+			{
+				const uint8_t* rows[5];
+				for (int m = 0; m < 5; ++m)
+					rows[m] = horizontal[Clamp(static_cast<int>(i) + m - 2, 0, height - 1) - b.halo_begin];
+
+				GaussianFilterColumns(rows, dst[i], width * channels);
+			}
+		});
+	}
+}
+
+
+// widths of the box filters whose repeated application approximates a gaussian of the given sigma,
+// see "Fast Almost-Gaussian Filtering" by W. Jarosz / P. Kovesi. returns the radius of each pass.
+std::vector<unsigned int> BoxRadiiForGauss(float sigma, unsigned int passes)
+{
+	std::vector<unsigned int> radii(passes, 0);
+	if (sigma <= 0.0f || passes == 0) return radii;
+
+	float ideal = std::sqrt(12.0f * sigma * sigma / passes + 1.0f);
+	int lower = static_cast<int>(ideal);
+	if (lower % 2 == 0) lower--;
+	int upper = lower + 2;
+
+	// number of passes that use the lower width
+	float m_ideal = (12.0f * sigma * sigma - passes * lower * lower - 4.0f * passes * lower - 3.0f * passes) / (-4.0f * lower - 4.0f);
+	auto m = static_cast<unsigned int>(Clamp(static_cast<int>(std::round(m_ideal)), 0, passes));
+
+	for (unsigned int i = 0; i < passes; ++i)
+		radii[i] = ((i < m ? lower : upper) - 1) / 2;
+	return radii;
+}
+
+// sigma of the low pass filter that should precede nearest downscaling by the given factor
+float AntiAliasSigma(float scale)
+{
+	if (scale <= 0.0f || scale >= 1.0f) return 0.0f;
+	return (1.0f / scale - 1.0f) / 2.0f;
+}
+
+// the mean of a window of 2r+1 values, rounded. shared by the scalar and the SSE2 code so that both
+// produce the same bytes.
+static inline uint8_t BoxMean(int sum, float inv)
+{
+	return static_cast<uint8_t>(static_cast<int>(sum * inv + 0.5f));
+}
+
+// X-axis running sum of one row with replicated edges, dst may be src
+static void BoxFilterRow(const uint8_t* src, uint8_t* dst, uint8_t* line, unsigned int width, unsigned int channels, unsigned int radius)
+{
+	unsigned int row_size = width * channels;
+	memcpy(line, src, row_size);
+
+	float inv = 1.0f / (2 * radius + 1);
+	int last = width - 1;
+
+	for (unsigned int c = 0; c < channels; ++c)
+	{
+		const uint8_t* in = line + c;
+		uint8_t* out = dst + c;
+
+		int sum = (radius + 1) * in[0];
+		for (unsigned int k = 1; k <= radius; ++k)
+			sum += in[std::min<int>(k, last) * channels];
+
+		for (unsigned int x = 0; x < width; ++x)
+		{
+			out[x * channels] = BoxMean(sum, inv);
+			sum += in[std::min<int>(x + radius + 1, last) * channels];
+			sum -= in[std::max<int>(static_cast<int>(x) - static_cast<int>(radius), 0) * channels];
+		}
+	}
+}
+
+// Y-axis running sum over all columns of a row at once
+static void BoxFilterColumns(ImageView<const uint8_t> src, ImageView<uint8_t> dst, unsigned int radius)
+{
+	unsigned int row_size = src.width * src.channels;
+	int last = src.height - 1;
+	float inv = 1.0f / (2 * radius + 1);
+
+	std::vector<int> sums(row_size);
+	for (unsigned int k = 0; k < row_size; ++k)
+		sums[k] = (radius + 1) * src[0][k];
+	for (unsigned int m = 1; m <= radius; ++m)
+	{
+		const uint8_t* row = src[std::min<int>(m, last)];
+		for (unsigned int k = 0; k < row_size; ++k)
+			sums[k] += row[k];
+	}
+
+	for (unsigned int i = 0; i < src.height; ++i)
+	{
+		const uint8_t* incoming = src[std::min<int>(i + radius + 1, last)];
+		const uint8_t* departing = src[std::max<int>(static_cast<int>(i) - static_cast<int>(radius), 0)];
+		uint8_t* out = dst[i];
+		int* sum = sums.data();
+		unsigned int k = 0;
+
+#ifdef PJ1_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 scale = _mm_set1_ps(inv);
+		const __m128 half = _mm_set1_ps(0.5f);
+
+		for (; k + 16 <= row_size; k += 16)
+		{
+			__m128i s[4], mean[4];
+			for (int q = 0; q < 4; ++q)
+			{
+				s[q] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sum + k + 4 * q));
+				mean[q] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(s[q]), scale), half));
+			}
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(mean[0], mean[1]), _mm_packs_epi32(mean[2], mean[3]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + k), packed);
+
+			__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(incoming + k));
+			__m128i de = _mm_loadu_si128(reinterpret_cast<const __m128i*>(departing + k));
+			__m128i in16[2] = {_mm_unpacklo_epi8(in, zero), _mm_unpackhi_epi8(in, zero)};
+			__m128i de16[2] = {_mm_unpacklo_epi8(de, zero), _mm_unpackhi_epi8(de, zero)};
+			for (int q = 0; q < 4; ++q)
+			{
+				__m128i in32 = q % 2 ? _mm_unpackhi_epi16(in16[q / 2], zero) : _mm_unpacklo_epi16(in16[q / 2], zero);
+				__m128i de32 = q % 2 ? _mm_unpackhi_epi16(de16[q / 2], zero) : _mm_unpacklo_epi16(de16[q / 2], zero);
+				s[q] = _mm_add_epi32(s[q], _mm_sub_epi32(in32, de32));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(sum + k + 4 * q), s[q]);
+			}
+		}
+#endif
+
+		for (; k < row_size; ++k)
+		{
+			out[k] = BoxMean(sum[k], inv);
+			sum[k] += incoming[k] - departing[k];
+		}
+	}
+}
+
+// one box filter of (2 * radius_x + 1) x (2 * radius_y + 1). the cost per pixel does not depend on
+// the radius. dst may alias src.
+void BoxFilter(ImageView<const uint8_t> src, ImageView<uint8_t> dst, unsigned int radius_x, unsigned int radius_y)
+{
+	unsigned int channels = src.channels;
+	std::vector<uint8_t> line(src.width * channels);
+
+	// a pass of radius 0 changes nothing, skip it
+	if (radius_y == 0)
+	{
+		for (unsigned int i = 0; i < src.height; ++i)
+			BoxFilterRow(src[i], dst[i], line.data(), src.width, channels, radius_x);
+		return;
+	}
+	if (radius_x == 0 && src.data != dst.data)
+	{
+		BoxFilterColumns(src, dst, radius_y);
+		return;
+	}
+
+	// X-axis into an intermediate image, the Y-axis pass needs the departing rows unmodified
+	Image<uint8_t> pixels(src.width, src.height, channels);
+	auto horizontal = pixels.View();
+
+	for (unsigned int i = 0; i < src.height; ++i)
+		BoxFilterRow(src[i], horizontal[i], line.data(), src.width, channels, radius_x);
+
+	BoxFilterColumns(horizontal, dst, radius_y);
+}
+
+// approximates a gaussian with sigma_x, sigma_y by repeated box filters. dst may alias src.
+void BoxBlur(ImageView<const uint8_t> src, ImageView<uint8_t> dst, float sigma_x, float sigma_y, unsigned int passes)
+{
+	PJ1_STAGE(Blur);
+	auto radii_x = BoxRadiiForGauss(sigma_x, passes);
+	auto radii_y = BoxRadiiForGauss(sigma_y, passes);
+
+	if (passes == 0)
+	{
+		CopyImage(src, dst);
+		return;
+	}
+
+	for (unsigned int i = 0; i < passes; ++i)
+	{
+		BoxFilter(i == 0 ? src : dst, dst, radii_x[i], radii_y[i]);
+	}
+}
+
+
+unsigned int HalfLength(unsigned int length)
+{
+	return length % 2 ? length / 2 + 1 : length / 2;
+}
+
+// 1 4 6 4 1 down the columns of five source rows. col must have two spare entries on both sides, they
+// are filled with the replicated edge columns.
+static void PyrDownColumns(const uint8_t* const rows[5], uint16_t* col, unsigned int width)
+{
+	unsigned int k = 0;
+
+#ifdef PJ1_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; k + 16 <= width; k += 16)
+	{
+		__m128i r[5];
+		for (int m = 0; m < 5; ++m)
+			r[m] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[m] + k));
+
+		for (int half = 0; half < 2; ++half)
+		{
+			auto widen = [&](__m128i v) { return half ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero); };
+			__m128i r2 = widen(r[2]);
+			__m128i sum = _mm_add_epi16(widen(r[0]), widen(r[4]));
+			sum = _mm_add_epi16(sum, _mm_slli_epi16(_mm_add_epi16(widen(r[1]), widen(r[3])), 2));
+			sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_slli_epi16(r2, 2), _mm_slli_epi16(r2, 1)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(col + k + 8 * half), sum);
+		}
+	}
+#endif
+
+	for (; k < width; ++k)
+		col[k] = rows[0][k] + rows[4][k] + 6 * rows[2][k] + 4 * (rows[1][k] + rows[3][k]);
+
+	col[-2] = col[-1] = col[0];
+	col[width] = col[width + 1] = col[width - 1];
+}
+
+// 1 4 6 4 1 along the column sums at every other column. the sums are at most 16 * 255, so the full
+// 2D sum plus rounding still fits in 16 bits.
+static void PyrDownRow(const uint16_t* col, uint8_t* dst, unsigned int src_width, unsigned int dst_width)
+{
+	unsigned int x = 0;
+
+#ifdef PJ1_SSE2
+	const __m128i low = _mm_set1_epi32(0xFFFF);
+	const __m128i round = _mm_set1_epi16(128);
+
+	// 16 sums starting at p into the 8 even and the 8 odd ones
+	auto split = [&](const uint16_t* p, __m128i& even, __m128i& odd)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8));
+		even = _mm_packs_epi32(_mm_and_si128(a, low), _mm_and_si128(b, low));
+		odd = _mm_packs_epi32(_mm_srli_epi32(a, 16), _mm_srli_epi32(b, 16));
+	};
+
+	for (; x + 8 <= dst_width && 2 * x + 16 <= src_width; x += 8)
+	{
+		__m128i left_even, left_odd, center_even, center_odd, right_even, right_odd;
+		split(col + 2 * x - 2, left_even, left_odd);
+		split(col + 2 * x, center_even, center_odd);
+		split(col + 2 * x + 2, right_even, right_odd);
+
+		__m128i sum = _mm_add_epi16(left_even, right_even);
+		sum = _mm_add_epi16(sum, _mm_slli_epi16(_mm_add_epi16(left_odd, center_odd), 2));
+		sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_slli_epi16(center_even, 2), _mm_slli_epi16(center_even, 1)));
+		sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 8);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(sum, sum));
+	}
+#endif
+
+	for (; x < dst_width; ++x)
+	{
+		const uint16_t* p = col + 2 * x;
+		dst[x] = (p[-2] + 4 * p[-1] + 6 * p[0] + 4 * p[1] + p[2] + 128) >> 8;
+	}
+}
+
+// a row that is not halved vertically, scaled by 16 like the sum of the five weighted rows
+static void PyrWidenRow(const uint8_t* src, uint16_t* col, unsigned int width)
+{
+	for (unsigned int k = 0; k < width; ++k)
+		col[k] = src[k] << 4;
+
+	col[-2] = col[-1] = col[0];
+	col[width] = col[width + 1] = col[width - 1];
+}
+
+// a row of column sums that is not halved horizontally
+static void PyrNarrowRow(const uint16_t* col, uint8_t* dst, unsigned int width)
+{
+	for (unsigned int k = 0; k < width; ++k)
+		dst[k] = (col[k] + 8) >> 4;
+}
+
+// one pass per level: every destination row filters five source rows vertically into a line of column
+// sums, then filters and decimates that line horizontally. either axis can be left at full size, which
+// gives the anisotropic levels of the ScaleCache.
+void PyrDown(ImageView<const uint8_t> src, ImageView<uint8_t> dst, bool halve_x, bool halve_y)
+{
+	PJ1_STAGE(Blur);
+	assert(src.channels == 1);
+
+	std::vector<uint16_t> columns(src.width + 4);
+	uint16_t* col = columns.data() + 2;
+	int last = src.height - 1;
+
+	for (unsigned int i = 0; i < dst.height; ++i)
+	{
+		if (halve_y)
+		{
+			const uint8_t* rows[5];
+			for (int m = 0; m < 5; ++m)
+				rows[m] = src[Clamp(static_cast<int>(2 * i) + m - 2, 0, last)];
+
+			PyrDownColumns(rows, col, src.width);
+		}
+		else
+			PyrWidenRow(src[i], col, src.width);
+
+		if (halve_x)
+			PyrDownRow(col, dst[i], src.width, dst.width);
+		else
+			PyrNarrowRow(col, dst[i], src.width);
+	}
+}
+
+void Pyramid::Build(ImageView<const uint8_t> gray, unsigned int max_levels, bool halve_x, bool halve_y)
+{
+	assert(gray.channels == 1);
+	Layout(gray.width, gray.height, max_levels, halve_x, halve_y);
+	if (levels.empty())
+		return;
+
+	CopyImage(gray, levels[0]);
+	Reduce();
+}
+
+void Pyramid::Layout(unsigned int width, unsigned int height, unsigned int max_levels, bool halve_x, bool halve_y)
+{
+	this->halve_x = halve_x;
+	this->halve_y = halve_y;
+
+	// lay out every level first, so that one allocation holds all of them
+	levels.clear();
+	std::vector<size_t> offsets;
+	size_t size = 0;
+
+	for (unsigned int i = 0; i < max_levels && width > 0 && height > 0; ++i)
+	{
+		auto stride = static_cast<std::ptrdiff_t>((width + 15) & ~15u);
+		offsets.push_back(size);
+		levels.push_back({nullptr, width, height, stride, 1});
+		size += (static_cast<size_t>(stride) * height + 63) & ~static_cast<size_t>(63);
+
+		if ((!halve_x || width == 1) && (!halve_y || height == 1))
+			break;
+		if (halve_x)
+			width = HalfLength(width);
+		if (halve_y)
+			height = HalfLength(height);
+	}
+
+	if (size > buffer.Size())
+		buffer = AlignedBuffer<uint8_t>(size);
+	for (size_t i = 0; i < levels.size(); ++i)
+		levels[i].data = buffer.Data() + offsets[i];
+}
+
+void Pyramid::Reduce()
+{
+	for (size_t i = 1; i < levels.size(); ++i)
+		PyrDown(levels[i - 1], levels[i], halve_x, halve_y);
+}
+
+int Clamp(int x, int min, int max)
+{
+	if (x < min) return min;
+	if (x > max) return max;
+	return x;
+}
+
+// the scales of one axis in ascending order, only those where the scaled image still holds the template.
+// the fixed grid goes from scale_min to scale_max, its steps are counted in double so that the scales do
+// not drift from the decimal values they stand for.
+// the automatic one starts at the scale where the object is min_object long, but not above 1, and every
+// step makes the object one template pixel longer, a factor of 1 + 1 / templ_length. a coarser step lets
+// the NCC miss the object between two scales. the steps end where the object fills the image or after
+// max_scales of them, so the budget cuts off the largest objects instead of thinning the steps: with the
+// default of 8 and a 16 pixel template the objects go from min_object to about 1.5x that.
+static std::vector<float> AxisScales(const MATCHCONFIG& config, unsigned int image_length, unsigned int templ_length)
+{
+	std::vector<float> scales;
+	if (templ_length == 0 || image_length < templ_length)
+		return scales;
+
+	if (config.scale_auto)
+	{
+		double low = static_cast<double>(templ_length) / image_length;
+		double high = std::min(1.0, static_cast<double>(templ_length) / std::max(config.min_object, templ_length));
+		if (low > high || config.max_scales == 0)
+			return scales;
+
+		double ratio = 1.0 + 1.0 / templ_length;
+		for (double scale = high; scale >= low * (1.0 - 1e-9) && scales.size() < config.max_scales; scale /= ratio)
+			scales.push_back(static_cast<float>(scale));
+		std::reverse(scales.begin(), scales.end());
+	}
+	else
+	{
+		if (config.scale_step <= 0.0f || config.scale_min <= 0.0f || config.scale_max < config.scale_min)
+			return scales;
+
+		auto steps = static_cast<unsigned int>(std::floor((static_cast<double>(config.scale_max) - config.scale_min) / config.scale_step + 1e-4));
+		for (unsigned int k = 0; k <= steps; ++k)
+			scales.push_back(static_cast<float>(static_cast<double>(config.scale_min) + static_cast<double>(k) * config.scale_step));
+	}
+
+	// rounding may leave the smallest scale a pixel short
+	std::erase_if(scales, [&](float scale) { return ScaledLength(image_length, scale) < templ_length; });
+	return scales;
+}
+
+// the feasible scales in the order they are searched, widths from large to small and heights from small to
+// large. decided from the sizes alone, before any pixel is touched.
+std::vector<HYPOTHESIS> ScaleHypotheses(const MATCHCONFIG& config, unsigned int image_width, unsigned int image_height, unsigned int templ_width, unsigned int templ_height)
+{
+	auto widths = AxisScales(config, image_width, templ_width);
+	auto heights = AxisScales(config, image_height, templ_height);
+
+	std::vector<HYPOTHESIS> hypotheses;
+	for (auto scaleWidth = widths.rbegin(); scaleWidth != widths.rend(); ++scaleWidth)
+	{
+		for (float scaleHeight : heights)
+		{
+			hypotheses.push_back({*scaleWidth, scaleHeight});
+		}
+	}
+	return hypotheses;
+}
+
+unsigned int ScaledLength(unsigned int length, float scale)
+{
+	return static_cast<unsigned int>(length * scale);
+}
+
+// the source row (or column) of every destination row (or column)
+std::vector<unsigned int> NearestIndexTable(unsigned int dst_length, unsigned int src_length, float scale)
+{
+	std::vector<unsigned int> table(dst_length);
+	for (unsigned int i = 0; i < dst_length; ++i)
+		table[i] = Clamp(static_cast<int>(i / scale), 0, src_length - 1);
+	return table;
+}
+
+// gathers one destination row, the pixels of 4-channel images are moved as 32 bit words
+static void NearestGatherRow(const uint8_t* src_row, uint8_t* dst_row, const unsigned int* src_cols, unsigned int width, unsigned int channels)
+{
+	unsigned int j = 0;
+
+	if (channels == 4)
+	{
+#ifdef PJ1_AVX2
+		for (; j + 8 <= width; j += 8)
+		{
+			__m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src_cols + j));
+			__m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(src_row), index, 4);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_row + 4 * j), pixels);
+		}
+#endif
+		for (; j < width; ++j)
+			memcpy(dst_row + 4 * j, src_row + 4 * src_cols[j], 4);
+	}
+	else if (channels == 1)
+	{
+		for (; j < width; ++j)
+			dst_row[j] = src_row[src_cols[j]];
+	}
+	else
+	{
+		for (; j < width; ++j)
+			memcpy(dst_row + j * channels, src_row + src_cols[j] * channels, channels);
+	}
+}
+
+// src_rows and src_cols are the index tables of the destination, see NearestIndexTable()
+void NearestScaling(ImageView<const uint8_t> src, ImageView<uint8_t> dst, const std::vector<unsigned int>& src_rows, const std::vector<unsigned int>& src_cols)
+{
+	PJ1_STAGE(Scale);
+	for (unsigned int i = 0; i < dst.height; ++i)
+	{
+		// upscaling repeats source rows, copy the row gathered last time
+		if (i > 0 && src_rows[i] == src_rows[i - 1])
+			memcpy(dst[i], dst[i - 1], dst.width * dst.channels);
+		else
+			NearestGatherRow(src[src_rows[i]], dst[i], src_cols.data(), dst.width, src.channels);
+	}
+}
+
+// dst should be ScaledLength(src.width, scaleWidth) x ScaledLength(src.height, scaleHeight)
+void NearestScaling(ImageView<const uint8_t> src, ImageView<uint8_t> dst, float scaleWidth, float scaleHeight)
+{
+	NearestScaling(src, dst, NearestIndexTable(dst.height, src.height, scaleHeight), NearestIndexTable(dst.width, src.width, scaleWidth));
+}
+
+
+// the number of halvings that keeps the image at least as large as the scale asks for
+unsigned int ScaleCache::Octave(float scale)
+{
+	unsigned int octave = 0;
+	while (octave < 16 && std::ldexp(1.0f, -static_cast<int>(octave) - 1) >= scale)
+		++octave;
+	return octave;
+}
+
+void ScaleCache::Build(ImageView<const uint8_t> gray, const MATCHCONFIG& config, const std::vector<HYPOTHESIS>& hypotheses, NCCWorkers* workers, bool thumbnails)
+{
+	width = gray.width;
+	height = gray.height;
+	blur = config.blur;
+	blur_passes = config.blur_passes;
+	columns.clear();
+
+	unsigned int octaves = 0;
+	row_octaves = 0;
+	if (blur == BlurMode::Pyramid)
+	{
+		for (auto& hypothesis : hypotheses)
+		{
+			octaves = std::max(octaves, Octave(hypothesis.scale_width));
+			row_octaves = std::max(row_octaves, Octave(hypothesis.scale_height));
+		}
+	}
+
+	levels.Layout(width, height, octaves + 1, true, false);
+	if (blur == BlurMode::Gaussian)
+		GaussianFilterNTimes(gray, levels.Base(), blur_passes, workers);
+	else
+		CopyImage(gray, levels.Base());
+	levels.Reduce();
+
+	// a thumbnail is at least as large as the scale asks for along both axes
+	unsigned int thumbnail_octaves = 0;
+	for (auto& hypothesis : hypotheses)
+		thumbnail_octaves = std::max(thumbnail_octaves, Octave(std::max(hypothesis.scale_width, hypothesis.scale_height) / 2));
+	this->thumbnails.Build(gray, thumbnails ? thumbnail_octaves + 1 : 0);
+}
+
+ScaleCache::Columns& ScaleCache::ForWidth(float scale_width)
+{
+	for (auto& cached : columns)
+	{
+		if (cached.scale_width == scale_width)
+			return cached;
+	}
+
+	Columns& result = columns.emplace_back();
+	result.scale_width = scale_width;
+
+	unsigned int a = 0;
+	if (blur == BlurMode::Pyramid)
+		a = std::min(Octave(scale_width), levels.Levels() - 1);
+
+	auto level = levels.Level(a);
+	if (blur == BlurMode::Box)
+	{
+		scratch.Resize(level.width, level.height);
+		BoxBlur(level, scratch.View(), AntiAliasSigma(scale_width), 0.0f, blur_passes);
+		level = scratch.View();
+	}
+
+	// what is left of the scale after the halvings of the level
+	float residual = std::ldexp(scale_width, a);
+
+	std::vector<unsigned int> same_rows(level.height);
+	for (unsigned int i = 0; i < level.height; ++i)
+		same_rows[i] = i;
+
+	result.rows.Layout(ScaledLength(width, scale_width), level.height, row_octaves + 1, false, true);
+	auto scaled = result.rows.Base();
+	NearestScaling(level, scaled, same_rows, NearestIndexTable(scaled.width, level.width, residual));
+	result.rows.Reduce();
+	return result;
+}
+
+void ScaleCache::Resample(float scale_width, float scale_height, Image<uint8_t>& dst)
+{
+	Columns& narrow = ForWidth(scale_width);
+
+	unsigned int b = 0;
+	ImageView<const uint8_t> level = narrow.rows.Level(0);
+	if (blur == BlurMode::Pyramid)
+	{
+		b = std::min(Octave(scale_height), narrow.rows.Levels() - 1);
+		level = narrow.rows.Level(b);
+	}
+	else if (blur == BlurMode::Box)
+	{
+		scratch.Resize(level.width, level.height);
+		BoxBlur(level, scratch.View(), 0.0f, AntiAliasSigma(scale_height), blur_passes);
+		level = scratch.View();
+	}
+
+	float residual = std::ldexp(scale_height, b);
+	dst.Resize(level.width, ScaledLength(height, scale_height));
+	auto scaled = dst.View();
+
+	PJ1_STAGE(Scale);
+	auto src_rows = NearestIndexTable(scaled.height, level.height, residual);
+	for (unsigned int i = 0; i < scaled.height; ++i)
+		memcpy(scaled[i], level[src_rows[i]], scaled.width);
+}
+
+void ScaleCache::Thumbnail(float scale_width, float scale_height, Image<uint8_t>& dst)
+{
+	assert(thumbnails.Levels() > 0);
+	float thumb_width = scale_width / 2;
+	float thumb_height = scale_height / 2;
+	unsigned int k = std::min(Octave(std::max(thumb_width, thumb_height)), thumbnails.Levels() - 1);
+	auto level = thumbnails.Level(k);
+
+	dst.Resize(HalfLength(ScaledLength(width, scale_width)), HalfLength(ScaledLength(height, scale_height)));
+	auto thumb = dst.View();
+	NearestScaling(level, thumb, NearestIndexTable(thumb.height, level.height, std::ldexp(thumb_height, k)),
+		NearestIndexTable(thumb.width, level.width, std::ldexp(thumb_width, k)));
+}
+
+void IntegralImage::Build(ImageView<const uint8_t> image)
+{
+	sum.Resize(image.width + 1, image.height + 1);
+	sqsum.Resize(image.width + 1, image.height + 1);
+	auto s = sum.View();
+	auto q = sqsum.View();
+
+	for (unsigned int j = 0; j <= image.width; ++j)
+		s[0][j] = q[0][j] = 0;
+
+	Rows(image, 0);
+}
+
+void IntegralImage::Update(ImageView<const uint8_t> image, unsigned int first_row)
+{
+	if (sum.GetWidth() != image.width + 1 || sum.GetHeight() != image.height + 1)
+	{
+		Build(image);
+		return;
+	}
+	Rows(image, first_row);
+}
+
+// the table rows below the image rows from first_row on
+void IntegralImage::Rows(ImageView<const uint8_t> image, unsigned int first_row)
+{
+	auto s = sum.View();
+	auto q = sqsum.View();
+
+	for (unsigned int i = first_row; i < image.height; ++i)
+	{
+		const uint8_t* row = image[i];
+		uint64_t row_sum = 0;
+		uint64_t row_sqsum = 0;
+		s[i + 1][0] = q[i + 1][0] = 0;
+
+		for (unsigned int j = 0; j < image.width; ++j)
+		{
+			row_sum += row[j];
+			row_sqsum += row[j] * row[j];
+			s[i + 1][j + 1] = s[i][j + 1] + row_sum;
+			q[i + 1][j + 1] = q[i][j + 1] + row_sqsum;
+		}
+	}
+}
+
+WindowStats::WindowStats(ImageView<const uint8_t> image, const IntegralImage* integral, unsigned int templ_width, unsigned int templ_height)
+	: image(image), integral(integral), templ_width(templ_width), templ_height(templ_height)
+{
+	if (!integral)
+	{
+		column_sum.resize(image.width);
+		column_sqsum.resize(image.width);
+	}
+}
+
+void WindowStats::Row(unsigned int i, uint64_t* sum, uint64_t* sqsum)
+{
+	unsigned int cols = image.width - templ_width + 1;
+
+	if (integral)
+	{
+		for (unsigned int j = 0; j < cols; ++j)
+			integral->Window(j, i, templ_width, templ_height, sum[j], sqsum[j]);
+		return;
+	}
+
+	if (valid && i == band + 1)
+	{
+		// slide the band down by one row
+		const uint8_t* departing = image[band];
+		const uint8_t* incoming = image[band + templ_height];
+		for (unsigned int x = 0; x < image.width; ++x)
+		{
+			column_sum[x] += incoming[x] - departing[x];
+			column_sqsum[x] += incoming[x] * incoming[x] - departing[x] * departing[x];
+		}
+	}
+	else if (!valid || i != band)
+	{
+		std::fill(column_sum.begin(), column_sum.end(), 0);
+		std::fill(column_sqsum.begin(), column_sqsum.end(), 0);
+		for (unsigned int m = i; m < i + templ_height; ++m)
+		{
+			const uint8_t* row = image[m];
+			for (unsigned int x = 0; x < image.width; ++x)
+			{
+				column_sum[x] += row[x];
+				column_sqsum[x] += row[x] * row[x];
+			}
+		}
+	}
+	band = i;
+	valid = true;
+
+	// slide the window to the right
+	uint64_t s = 0;
+	uint64_t q = 0;
+	for (unsigned int x = 0; x < templ_width; ++x)
+	{
+		s += column_sum[x];
+		q += column_sqsum[x];
+	}
+	for (unsigned int j = 0; j < cols; ++j)
+	{
+		sum[j] = s;
+		sqsum[j] = q;
+		if (j + 1 < cols)
+		{
+			s += column_sum[j + templ_width];
+			s -= column_sum[j];
+			q += column_sqsum[j + templ_width];
+			q -= column_sqsum[j];
+		}
+	}
+}
+
+void TemplateStats::Build(ImageView<const uint8_t> templ)
+{
+	unsigned int size = templ.GetSize();
+	centered.Resize(templ.width, templ.height);
+	auto c = centered.View();
+
+	uint64_t sum = 0;
+	for (unsigned int i = 0; i < templ.height; ++i)
+		for (unsigned int j = 0; j < templ.width; ++j)
+			sum += templ[i][j];
+	float mean = (float) sum / size;
+
+	float variance = 0.0f;
+	for (unsigned int i = 0; i < templ.height; ++i)
+	{
+		for (unsigned int j = 0; j < templ.width; ++j)
+		{
+			c[i][j] = templ[i][j] - mean;
+			variance += c[i][j] * c[i][j];
+		}
+	}
+	standard_deviation = std::sqrt(variance / size);
+}
+
+NCCRows::NCCRows(ImageView<const uint8_t> image, const IntegralImage* integral, const TemplateStats& templ)
+	: image(image), templ(templ), stats(image, integral, templ.Centered().width, templ.Centered().height),
+	  width(image.width - templ.Centered().width + 1), sums(width), sqsums(width)
+{
+}
+
+// the normalized cross correlation coefficient(NCC)
+// more information on math:https://blog.csdn.net/fb_help/article/details/104162770
+// the template mean is removed beforehand, so sum((i - i_mean) * (t - t_mean)) is just sum(i * (t - t_mean)),
+// and the mean and the standard deviation of the image window come from WindowStats.
+void NCCRows::Row(unsigned int i, float* ncc, unsigned int begin, unsigned int end)
+{
+	auto centered = templ.Centered();
+	unsigned int templ_size = centered.GetSize();
+
+	if (row != i)
+	{
+		stats.Row(i, sums.data(), sqsums.data());
+		row = i;
+	}
+
+	for (unsigned int j = begin; j < end; ++j)
+	{
+		uint64_t i_sum = sums[j];
+		uint64_t i_sqsum = sqsums[j];
+
+		double i_variance = ((double) i_sqsum - (double) i_sum * i_sum / templ_size) / templ_size;
+		if (i_variance <= 0.0 || templ.StandardDeviation() <= 0.0f)
+		{
+			// flat window or template
+			ncc[j] = 0.0f;
+			continue;
+		}
+		float i_standard_deviation = (float) std::sqrt(i_variance);
+
+		float r = 0;
+		for (unsigned int m = 0; m < centered.height; ++m)
+		{
+			const uint8_t* image_row = image[i + m] + j;
+			const float* templ_row = centered[m];
+			for (unsigned int n = 0; n < centered.width; ++n)
+				r += image_row[n] * templ_row[n];
+		}
+
+		ncc[j] = r / (i_standard_deviation * templ.StandardDeviation() * templ_size);
+	}
+}
+
+// the peaks of one NCC row, above and below are its neighbour rows or nullptr at the edges of the map.
+// on a plateau only the first value in row-major order counts as the maximum.
+void FindPeaks(const float* above, const float* row, const float* below, unsigned int width, unsigned int y, PeakMode mode, float threshold, std::vector<PEAK>& peaks)
+{
+	for (unsigned int j = 0; j < width; ++j)
+	{
+		float v = row[j];
+		if (!(v > threshold))
+			continue;
+
+		if (mode == PeakMode::LocalMax)
+		{
+			unsigned int left = j > 0 ? j - 1 : j;
+			unsigned int right = j + 1 < width ? j + 1 : j;
+			bool maximum = true;
+			for (unsigned int n = left; n <= right && maximum; ++n)
+			{
+				if (above && above[n] >= v)
+					maximum = false;
+				if (below && below[n] > v)
+					maximum = false;
+			}
+			if ((j > 0 && row[j - 1] >= v) || (j + 1 < width && row[j + 1] > v))
+				maximum = false;
+			if (!maximum)
+				continue;
+		}
+
+		peaks.push_back({j, y, v});
+	}
+}
+
+NCCWorkers::NCCWorkers(unsigned int threads, bool affinity) : workers(threads)
+{
+	for (unsigned int t = 0; t < threads; ++t)
+		workers[t].thread = std::thread(&NCCWorkers::Loop, this, t, affinity);
+}
+
+NCCWorkers::~NCCWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+
+	for (auto& worker : workers)
+		worker.thread.join();
+}
+
+bool NCCWorkers::Run(ImageView<const uint8_t> image, const TemplateStats& templ, StatsMode stats, PeakMode peaks, float threshold, HEATMAP* heatmap,
+	std::chrono::steady_clock::time_point deadline)
+{
+	// the workers wait between jobs, Dispatch publishes it to them
+	this->image = image;
+	this->templ = &templ;
+	this->stats = stats;
+	this->peak_mode = peaks;
+	this->threshold = threshold;
+	this->heatmap = heatmap;
+	this->deadline = deadline;
+	job = Job::Full;
+	frame = nullptr;
+	return Dispatch();
+}
+
+bool NCCWorkers::Update(ImageView<const uint8_t> image, const TemplateStats& templ, PeakMode peaks, float threshold, FRAMEMAP& frame, HEATMAP* heatmap,
+	std::chrono::steady_clock::time_point deadline)
+{
+	auto centered = templ.Centered();
+	tiles_x = (image.width + tile - 1) / tile;
+	unsigned int tiles_y = (image.height + tile - 1) / tile;
+
+	// the changed tiles, and a copy of the rows they are in for the next frame
+	bool same = frame.valid && frame.scaled.GetWidth() == image.width && frame.scaled.GetHeight() == image.height;
+	dirty.assign(static_cast<size_t>(tiles_x) * tiles_y, same ? 0 : 1);
+	frame.scaled.Resize(image.width, image.height);
+	auto previous = frame.scaled.View();
+	unsigned int first_row = same ? image.height : 0;
+	for (unsigned int i = 0; i < image.height; ++i)
+	{
+		if (same)
+		{
+			uint8_t* tiles = dirty.data() + static_cast<size_t>(i / tile) * tiles_x;
+			bool changed = false;
+			for (unsigned int tx = 0; tx < tiles_x; ++tx)
+			{
+				unsigned int x = tx * tile;
+				if (memcmp(previous[i] + x, image[i] + x, std::min(tile, image.width - x)) != 0)
+				{
+					tiles[tx] = 1;
+					changed = true;
+				}
+			}
+			if (!changed)
+				continue;
+			first_row = std::min(first_row, i);
+		}
+		memcpy(previous[i], image[i], image.width);
+	}
+	frame.integral.Update(previous, first_row);
+	frame.ncc.Resize(image.width - centered.width + 1, image.height - centered.height + 1);
+
+	// a map cut short by the deadline is computed again in full next time
+	frame.valid = false;
+
+	this->image = previous;
+	this->templ = &templ;
+	this->stats = StatsMode::Integral;
+	this->peak_mode = peaks;
+	this->threshold = threshold;
+	this->heatmap = heatmap;
+	this->deadline = deadline;
+	this->frame = &frame;
+
+	// every row of the map has to be refreshed before the local maxima can look at their neighbours
+	job = Job::Refresh;
+	Dispatch();
+	job = Job::Scan;
+	frame.valid = Dispatch();
+	return frame.valid;
+}
+
+bool NCCWorkers::Dispatch()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = static_cast<unsigned int>(workers.size());
+		++generation;
+	}
+	wake.notify_all();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return pending == 0; });
+
+	bool complete = true;
+	for (auto& worker : workers)
+		complete = complete && worker.complete;
+	return complete;
+}
+
+void NCCWorkers::Each(const std::function<void(unsigned int)>& task)
+{
+	job = Job::Task;
+	this->task = &task;
+	Dispatch();
+	this->task = nullptr;
+}
+
+void NCCWorkers::Loop(unsigned int t, bool affinity)
+{
+	if (affinity)
+		PinCurrentThread(t);
+
+	unsigned int seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stop || generation != seen; });
+			if (stop)
+				return;
+			seen = generation;
+		}
+
+		if (job == Job::Task)
+			(*task)(t);
+		else
+			Compute(t);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pending == 0)
+			done.notify_one();
+	}
+}
+
+void NCCWorkers::Compute(unsigned int t)
+{
+	PJ1_STAGE(NCC);
+	if (job == Job::Refresh)
+	{
+		Refresh(t);
+		return;
+	}
+	if (job == Job::Scan)
+	{
+		Scan(t);
+		return;
+	}
+
+	Worker& worker = workers[t];
+	worker.peaks.clear();
+
+	auto centered = templ->Centered();
+	unsigned int rows = image.height - centered.height + 1;
+	unsigned int cols = image.width - centered.width + 1;
+	unsigned int threads = static_cast<unsigned int>(workers.size());
+
+	unsigned int begin = rows * t / threads;
+	unsigned int end = rows * (t + 1) / threads;
+	worker.best = {0, 0, -std::numeric_limits<float>::infinity()};
+	worker.sum = worker.sqsum = worker.count = 0.0;
+	worker.complete = true;
+	if (begin == end)
+		return;
+
+	// local maxima also need the NCC rows just outside the tile
+	bool local_max = peak_mode == PeakMode::LocalMax;
+	unsigned int first = local_max && begin > 0 ? begin - 1 : begin;
+	unsigned int last = local_max && end < rows ? end + 1 : end;
+
+	// the image rows the windows of these rows cover
+	auto band = image.Crop(0, first, image.width, last - first + centered.height - 1);
+	if (stats == StatsMode::Integral)
+		worker.integral.Build(band);
+
+	NCCRows ncc(band, stats == StatsMode::Integral ? &worker.integral : nullptr, *templ);
+	worker.window.Resize(cols, 3);
+	auto window = worker.window.View();
+
+	bool timed = deadline != std::chrono::steady_clock::time_point::max();
+	for (unsigned int i = first; i < last; ++i)
+	{
+		// the clock is read every 16 rows
+		if (timed && (i - first) % 16 == 0 && std::chrono::steady_clock::now() >= deadline)
+		{
+			worker.complete = false;
+			return;
+		}
+
+		ncc.Row(i - first, window[i % 3]);
+		if (i >= begin && i < end)
+			Tally(worker, window[i % 3], cols, i);
+
+		if (!local_max)
+			FindPeaks(nullptr, window[i % 3], nullptr, cols, i, peak_mode, threshold, worker.peaks);
+		else if (i > begin)
+			FindPeaks(i - 1 > first ? window[(i - 2) % 3] : nullptr, window[(i - 1) % 3], window[i % 3], cols, i - 1, peak_mode, threshold, worker.peaks);
+	}
+
+	// the last row of the map has no row below it
+	if (local_max && last == end)
+		FindPeaks(end - 1 > first ? window[(end - 2) % 3] : nullptr, window[(end - 1) % 3], nullptr, cols, end - 1, peak_mode, threshold, worker.peaks);
+}
+
+// the rows of tile t in frame->ncc whose windows overlap a changed tile of the image
+void NCCWorkers::Refresh(unsigned int t)
+{
+	Worker& worker = workers[t];
+
+	auto centered = templ->Centered();
+	unsigned int rows = image.height - centered.height + 1;
+	unsigned int cols = image.width - centered.width + 1;
+	unsigned int threads = static_cast<unsigned int>(workers.size());
+
+	unsigned int begin = rows * t / threads;
+	unsigned int end = rows * (t + 1) / threads;
+	worker.refreshed = begin;
+
+	NCCRows ncc(image, &frame->integral, *templ);
+	auto map = frame->ncc.View();
+	worker.columns.resize(tiles_x);
+
+	bool timed = deadline != std::chrono::steady_clock::time_point::max();
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		// the clock is read every 16 rows
+		if (timed && (i - begin) % 16 == 0 && std::chrono::steady_clock::now() >= deadline)
+			return;
+
+		// the tile columns that changed in the image rows of the windows
+		std::fill(worker.columns.begin(), worker.columns.end(), 0);
+		for (unsigned int ty = i / tile; ty <= (i + centered.height - 1) / tile; ++ty)
+			for (unsigned int tx = 0; tx < tiles_x; ++tx)
+				worker.columns[tx] |= dirty[static_cast<size_t>(ty) * tiles_x + tx];
+
+		// a window overlaps a run of changed columns if it starts less than a template width left of it
+		unsigned int done = 0;
+		for (unsigned int tx = 0; tx < tiles_x; ++tx)
+		{
+			if (!worker.columns[tx])
+				continue;
+			unsigned int run_end = tx + 1;
+			while (run_end < tiles_x && worker.columns[run_end])
+				++run_end;
+
+			unsigned int left = std::max(done, tx * tile >= centered.width ? tx * tile - centered.width + 1 : 0);
+			unsigned int right = std::min(cols, run_end * tile);
+			if (left < right)
+				ncc.Row(i, map[i], left, right);
+			done = std::max(done, right);
+			tx = run_end;
+		}
+		worker.refreshed = i + 1;
+	}
+}
+
+// the peaks and the summary of the refreshed rows of tile t of frame->ncc
+void NCCWorkers::Scan(unsigned int t)
+{
+	Worker& worker = workers[t];
+	worker.peaks.clear();
+
+	auto centered = templ->Centered();
+	unsigned int rows = image.height - centered.height + 1;
+	unsigned int cols = image.width - centered.width + 1;
+	unsigned int threads = static_cast<unsigned int>(workers.size());
+
+	unsigned int end = rows * (t + 1) / threads;
+	worker.best = {0, 0, -std::numeric_limits<float>::infinity()};
+	worker.sum = worker.sqsum = worker.count = 0.0;
+	worker.complete = worker.refreshed == end;
+
+	auto map = frame->ncc.View();
+	bool local_max = peak_mode == PeakMode::LocalMax;
+	for (unsigned int i = rows * t / threads; i < worker.refreshed; ++i)
+	{
+		Tally(worker, map[i], cols, i);
+		FindPeaks(local_max && i > 0 ? map[i - 1] : nullptr, map[i], local_max && i + 1 < rows ? map[i + 1] : nullptr, cols, i, peak_mode, threshold, worker.peaks);
+	}
+}
+
+// row y of the map into the summary of the worker and the heatmap
+void NCCWorkers::Tally(Worker& worker, const float* row, unsigned int cols, unsigned int y)
+{
+	for (unsigned int j = 0; j < cols; ++j)
+	{
+		worker.sum += row[j];
+		worker.sqsum += row[j] * row[j];
+		if (row[j] > worker.best.ncc)
+			worker.best = {j, y, row[j]};
+	}
+	worker.count += cols;
+	if (heatmap)
+		EncodeHeatmapRow(row, cols, heatmap->format, heatmap->Row(y));
+}
+
+NCCSUMMARY NCCWorkers::Summary() const
+{
+	auto centered = templ->Centered();
+
+	// only the rows that were done before the deadline
+	NCCSUMMARY summary = {{0, 0, -std::numeric_limits<float>::infinity()}, 0.0f, 0.0f, 0.0f};
+	double sum = 0.0, sqsum = 0.0, count = 0.0;
+	for (auto& worker : workers)
+	{
+		if (worker.best.ncc > summary.best.ncc)
+			summary.best = worker.best;
+		sum += worker.sum;
+		sqsum += worker.sqsum;
+		count += worker.count;
+	}
+	if (count == 0.0)
+		return summary;
+	summary.mean = static_cast<float>(sum / count);
+	summary.deviation = static_cast<float>(std::sqrt(std::max(0.0, sqsum / count - (sum / count) * (sum / count))));
+
+	// every value that is not a peak is at most the threshold
+	auto far = [&](const PEAK& peak)
+	{
+		return std::max(peak.x, summary.best.x) - std::min(peak.x, summary.best.x) >= centered.width ||
+			std::max(peak.y, summary.best.y) - std::min(peak.y, summary.best.y) >= centered.height;
+	};
+	summary.second = std::min(threshold, summary.best.ncc);
+	for (auto& worker : workers)
+	{
+		if (far(worker.best))
+			summary.second = std::max(summary.second, worker.best.ncc);
+		for (auto& peak : worker.peaks)
+			if (far(peak))
+				summary.second = std::max(summary.second, peak.ncc);
+	}
+	return summary;
+}
+
+bool Confident(const NCCSUMMARY& summary, const MATCHCONFIG& config)
+{
+	return summary.best.ncc >= config.stop_ncc &&
+		summary.best.ncc - summary.second >= config.stop_margin &&
+		summary.best.ncc - summary.mean >= config.stop_sharpness * summary.deviation;
+}
+
+#ifdef PJ1_PROFILE
+PerfCounters::PerfCounters()
+{
+#if defined(__linux__)
+	static const std::pair<uint32_t, uint64_t> events[count] =
+	{
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+	};
+
+	// one group, so that all counters see the same instructions
+	for (int k = 0; k < count; ++k)
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = events[k].first;
+		attr.config = events[k].second;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+		if (fd < 0)
+			continue;
+		if (leader < 0)
+			leader = fd;
+		fds.push_back(fd);
+		slots.push_back(k);
+		available[k] = true;
+	}
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#if defined(__linux__)
+	// the leader last
+	for (auto it = fds.rbegin(); it != fds.rend(); ++it)
+		close(*it);
+#endif
+}
+
+void PerfCounters::Read(uint64_t values[count]) const
+{
+	std::fill(values, values + count, 0);
+#if defined(__linux__)
+	uint64_t group[1 + count];
+	if (leader < 0 || read(leader, group, sizeof(group)) < static_cast<ssize_t>(sizeof(uint64_t)))
+		return;
+	for (uint64_t i = 0; i < group[0] && i < slots.size(); ++i)
+		values[slots[i]] = group[1 + i];
+#endif
+}
+
+void PrintStageReport(std::ostream& out)
+{
+	static const char* const stages[] = {"load", "gray", "blur", "scale", "ncc", "output"};
+
+	out << std::format("\n{:<8}{:>8}{:>12}", "stage", "calls", "thread ms");
+	for (int k = 0; k < PerfCounters::count; ++k)
+		if (PerfCounters::Available(k))
+			out << std::format("{:>16}", PerfCounters::names[k]);
+	if (PerfCounters::Available(0) && PerfCounters::Available(1))
+		out << std::format("{:>8}", "IPC");
+	out << '\n';
+
+	for (int s = 0; s < static_cast<int>(Stage::Count); ++s)
+	{
+		auto& totals = stage_totals[s];
+		out << std::format("{:<8}{:>8}{:>12.3f}", stages[s], totals.calls.load(), totals.nanoseconds / 1e6);
+		for (int k = 0; k < PerfCounters::count; ++k)
+			if (PerfCounters::Available(k))
+				out << std::format("{:>16}", totals.counters[k].load());
+		if (PerfCounters::Available(0) && PerfCounters::Available(1))
+			out << std::format("{:>8.2f}", totals.counters[0] ? (double) totals.counters[1] / totals.counters[0] : 0.0);
+		out << '\n';
+	}
+
+	if (!PerfCounters::Available(0))
+		out << "no hardware counters, see /proc/sys/kernel/perf_event_paranoid\n";
+}
+#endif
+
+void Tracer::Start(const std::string& filename)
+{
+	Tracer::filename = filename;
+	start = std::chrono::steady_clock::now();
+	enabled = true;
+	std::atexit(Write);
+}
+
+Tracer::Buffer& Tracer::ThisThread()
+{
+	// the buffers outlive their threads, they are only read at exit
+	thread_local Buffer* buffer = []
+	{
+		auto added = new Buffer;
+		added->tid = threads++;
+		added->next = buffers.load(std::memory_order_relaxed);
+		while (!buffers.compare_exchange_weak(added->next, added, std::memory_order_release, std::memory_order_relaxed))
+			;
+		return added;
+	}();
+	return *buffer;
+}
+
+void Tracer::Record(const char* name, char phase)
+{
+	auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	Buffer& buffer = ThisThread();
+	uint64_t head = buffer.head.load(std::memory_order_relaxed);
+	buffer.events[head % Buffer::capacity] = {static_cast<uint64_t>(time), name, phase};
+	buffer.head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::Write()
+{
+	enabled = false;
+
+	std::ofstream file(filename, std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "cannot write " << filename << '\n';
+		return;
+	}
+
+	std::string out = "{\"traceEvents\":[\n";
+	bool first = true;
+	for (Buffer* buffer = buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+	{
+		out += std::format("{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"thread {}\"}}}}",
+			first ? "" : ",\n", buffer->tid, buffer->tid);
+		first = false;
+
+		uint64_t head = buffer->head.load(std::memory_order_acquire);
+		uint64_t begin = head > Buffer::capacity ? head - Buffer::capacity : 0;
+		for (uint64_t k = begin; k < head; ++k)
+		{
+			const EVENT& event = buffer->events[k % Buffer::capacity];
+			out += std::format(",\n{{\"name\":\"{}\",\"ph\":\"{}\",\"ts\":{:.3f},\"pid\":1,\"tid\":{}}}",
+				event.name, event.phase, event.time / 1000.0, buffer->tid);
+		}
+	}
+	out += "\n]}\n";
+	file << out;
+}
+
+// round to nearest even, overflow goes to infinity and underflow through the subnormals to zero
+uint16_t FloatToHalf(float value)
+{
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = (f >> 16) & 0x8000;
+	uint32_t exponent = (f >> 23) & 0xFF;
+	uint32_t mantissa = f & 0x7FFFFF;
+
+	if (exponent == 0xFF)
+		return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+
+	int e = static_cast<int>(exponent) - 127 + 15;
+	if (e >= 31)
+		return static_cast<uint16_t>(sign | 0x7C00);
+
+	unsigned int shift = 13;
+	uint32_t half = static_cast<uint32_t>(e) << 10;
+	if (e <= 0)
+	{
+		if (e < -10)
+			return static_cast<uint16_t>(sign);
+		mantissa |= 0x800000;
+		shift = 14 - e;
+		half = 0;
+	}
+
+	// a carry out of the mantissa correctly bumps the exponent
+	uint32_t rest = mantissa & ((1u << shift) - 1);
+	uint32_t middle = 1u << (shift - 1);
+	half |= mantissa >> shift;
+	if (rest > middle || (rest == middle && (half & 1)))
+		++half;
+	return static_cast<uint16_t>(sign | half);
+}
+
+void EncodeHeatmapRow(const float* ncc, unsigned int width, HeatmapFormat format, uint8_t* dst)
+{
+	if (format == HeatmapFormat::Float16)
+	{
+		for (unsigned int j = 0; j < width; ++j)
+		{
+			uint16_t half = FloatToHalf(ncc[j]);
+			dst[2 * j] = static_cast<uint8_t>(half);
+			dst[2 * j + 1] = static_cast<uint8_t>(half >> 8);
+		}
+		return;
+	}
+
+	for (unsigned int j = 0; j < width; ++j)
+	{
+		float v = std::clamp((ncc[j] + 1.0f) * 127.5f, 0.0f, 255.0f);
+		dst[j] = static_cast<uint8_t>(v + 0.5f);
+	}
+}
+
+// little endian whatever the host is
+static void PutU32(uint8_t* p, uint32_t value)
+{
+	for (int k = 0; k < 4; ++k)
+		p[k] = static_cast<uint8_t>(value >> (8 * k));
+}
+
+static void PutF32(uint8_t* p, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	PutU32(p, bits);
+}
+
+HeatmapWriter::HeatmapWriter(const std::string& filename, HeatmapFormat format)
+	: file(filename, std::ios::binary | std::ios::trunc), format(format)
+{
+	if (!file)
+		return;
+
+	// the map count is filled in when the file is closed
+	uint8_t header[64] = {'N', 'C', 'C', 'H'};
+	PutU32(header + 4, 1);
+	PutU32(header + 8, static_cast<uint32_t>(format));
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	thread = std::thread(&HeatmapWriter::Loop, this);
+}
+
+HeatmapWriter::~HeatmapWriter()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+
+	uint8_t count[4];
+	PutU32(count, maps);
+	file.seekp(12);
+	file.write(reinterpret_cast<const char*>(count), sizeof(count));
+}
+
+void HeatmapWriter::Write(HEATMAP heatmap)
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(std::move(heatmap));
+	}
+	wake.notify_one();
+}
+
+void HeatmapWriter::Loop()
+{
+	std::vector<HEATMAP> batch;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stop || !queue.empty(); });
+			if (queue.empty())
+				return;
+			batch.swap(queue);
+		}
+
+		for (auto& heatmap : batch)
+		{
+			PJ1_STAGE(Output);
+			uint8_t header[64] = {};
+			PutF32(header, heatmap.scale_width);
+			PutF32(header + 4, heatmap.scale_height);
+			PutU32(header + 8, heatmap.width);
+			PutU32(header + 12, heatmap.height);
+			file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+			static const char padding[64] = {};
+			file.write(reinterpret_cast<const char*>(heatmap.data.data()), heatmap.data.size());
+			file.write(padding, (64 - heatmap.data.size() % 64) % 64);
+			++maps;
+		}
+		batch.clear();
+	}
+}
+
+ResultSink::ResultSink(ResultFormat format) : format(format)
+{
+	static const char* const names[] = {"output.txt", "output.csv", "output.jsonl"};
+	file.open(names[static_cast<int>(format)], std::ios::app);
+	if (!file)
+		std::cerr << "cannot write " << names[static_cast<int>(format)] << '\n';
+	else if (format == ResultFormat::CSV && file.tellp() == 0)
+		file << "image,rank,x,y,width,height,accuracy,iou,time_ms,complete\n";
+
+	thread = std::thread(&ResultSink::Loop, this);
+}
+
+ResultSink::~ResultSink()
+{
+	Push(new Node{0, std::nullopt, true, nullptr});
+	thread.join();
+}
+
+void ResultSink::Submit(size_t job, RESULT result)
+{
+	Push(new Node{job, std::move(result), false, nullptr});
+}
+
+void ResultSink::Skip(size_t job)
+{
+	Push(new Node{job, std::nullopt, false, nullptr});
+}
+
+void ResultSink::Push(Node* node)
+{
+	node->next = head.load(std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+		;
+	head.notify_one();
+}
+
+void ResultSink::Loop()
+{
+	std::map<size_t, std::optional<RESULT>> early;
+	size_t next = 0;
+	bool last = false;
+	std::string buffer;
+
+	while (!last)
+	{
+		head.wait(nullptr, std::memory_order_acquire);
+		Node* list = head.exchange(nullptr, std::memory_order_acquire);
+
+		// the list is newest first
+		std::vector<Node*> nodes;
+		for (; list; list = list->next)
+			nodes.push_back(list);
+		for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+		{
+			if ((*it)->last)
+				last = true;
+			else
+				early.emplace((*it)->job, std::move((*it)->result));
+			delete *it;
+		}
+
+		// in order while there are no gaps, and everything at the end
+		PJ1_STAGE(Output);
+		buffer.clear();
+		for (auto it = early.begin(); it != early.end() && (last || it->first == next); it = early.erase(it))
+		{
+			if (it->second)
+				Format(*it->second, buffer);
+			next = it->first + 1;
+		}
+		file << buffer;
+		file.flush();
+	}
+}
+
+static std::string JsonString(const std::string& text)
+{
+	std::string out = "\"";
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if (static_cast<unsigned char>(c) < 0x20)
+			out += std::format("\\u{:04x}", c);
+		else
+			out += c;
+	}
+	return out + '"';
+}
+
+void ResultSink::Format(const RESULT& result, std::string& out) const
+{
+	float sum = 0.0f;
+	for (auto& match : result.matches)
+		sum += match.accuracy;
+	float average = sum / result.matches.size();
+
+	switch (format)
+	{
+	case ResultFormat::Text:
+	{
+		// exactly what operator<< used to write
+		std::ostringstream text;
+		text << result.image_name << ":\n";
+		text << "coordinates accuracy IoU\n";
+		for (auto& match : result.matches)
+			text << '(' << match.x << ", " << match.y << ") " << match.accuracy << ' ' << match.IoU << '\n';
+		text << "average precision:" << average << " " << "processing time(ms):" << result.time;
+		if (!result.complete)
+			text << " deadline hit";
+		text << "\n\n";
+		out += text.str();
+		break;
+	}
+
+	case ResultFormat::CSV:
+		for (size_t k = 0; k < result.matches.size(); ++k)
+		{
+			auto& match = result.matches[k];
+			out += std::format("{},{},{},{},{},{},{},{},{},{}\n", result.image_name, k + 1, match.x, match.y,
+				match.templ_scaled_width, match.templ_scaled_height, match.accuracy, match.IoU, result.time, result.complete ? 1 : 0);
+		}
+		break;
+
+	case ResultFormat::JSONL:
+		out += "{\"image\":" + JsonString(result.image_name) + ",\"matches\":[";
+		for (size_t k = 0; k < result.matches.size(); ++k)
+		{
+			auto& match = result.matches[k];
+			out += std::format("{}{{\"x\":{},\"y\":{},\"width\":{},\"height\":{},\"accuracy\":{},\"iou\":{}}}", k ? "," : "",
+				match.x, match.y, match.templ_scaled_width, match.templ_scaled_height, match.accuracy, match.IoU);
+		}
+		// no matches leave the average undefined
+		out += "],\"average_precision\":" + (result.matches.empty() ? std::string("null") : std::format("{}", average));
+		out += std::format(",\"time_ms\":{},\"complete\":{}}}\n", result.time, result.complete);
+		break;
+	}
+}
+
+bool DescendingWithAccuracy(OUTPUTFORMAT a, OUTPUTFORMAT b)
+{
+	return a.accuracy > b.accuracy;
+}
+
+
+template <typename T>
+bool ParseNumber(const std::string& text, T& value, T min, T max)
+{
+	// an unsigned T takes no sign, so -1 cannot wrap around. NaN is out of every range
+	T parsed = {};
+	const char* end = text.data() + text.size();
+	auto [last, error] = std::from_chars(text.data(), end, parsed);
+	if (error != std::errc() || last != end || !(parsed >= min && parsed <= max))
+		return false;
+	value = parsed;
+	return true;
+}
+
+// why ParseOption refused arg, where is the position in a config file. LoadConfig has already said why a
+// --config failed
+void OptionError(const std::string& arg, const std::string& where)
+{
+	if (arg.rfind("--config=", 0) != 0)
+		std::cerr << where << "unknown option or bad value " << arg << '\n';
+}
+
+// the options every binary shares
+bool ParseOption(const std::string& arg, MATCHCONFIG& config)
+{
+	if (arg == "--scales=auto")
+		config.scale_auto = true;
+	else if (arg.rfind("--scales=", 0) == 0)
+	{
+		float min = 0.0f, max = 0.0f, step = 0.0f;
+		if (sscanf(arg.c_str() + 9, "%f:%f:%f", &min, &max, &step) != 3 || min <= 0.0f || max < min || step <= 0.0f)
+			return false;
+		config.scale_min = min;
+		config.scale_max = max;
+		config.scale_step = step;
+		config.scale_auto = false;
+	}
+	else if (arg.rfind("--min-object=", 0) == 0)
+		return ParseNumber(arg.substr(13), config.min_object, 0u, 1u << 20);
+	else if (arg.rfind("--max-scales=", 0) == 0)
+		return ParseNumber(arg.substr(13), config.max_scales, 1u, 1024u);
+	else if (arg.rfind("--threshold=", 0) == 0)
+		return ParseNumber(arg.substr(12), config.threshold, -1.0f, 1.0f);
+	else if (arg == "--stop=none")
+		config.stop = StopMode::None;
+	else if (arg == "--stop=accuracy")
+		config.stop = StopMode::Accuracy;
+	else if (arg == "--stop=confidence")
+		config.stop = StopMode::Confidence;
+	else if (arg.rfind("--stop-accuracy=", 0) == 0)
+		return ParseNumber(arg.substr(16), config.stop_accuracy, 0.0f, 1.0f);
+	else if (arg.rfind("--stop-ncc=", 0) == 0)
+		return ParseNumber(arg.substr(11), config.stop_ncc, -1.0f, 1.0f);
+	else if (arg.rfind("--stop-margin=", 0) == 0)
+		return ParseNumber(arg.substr(14), config.stop_margin, 0.0f, 2.0f);
+	else if (arg.rfind("--stop-sharpness=", 0) == 0)
+		return ParseNumber(arg.substr(17), config.stop_sharpness, 0.0f, 1000.0f);
+	else if (arg.rfind("--deadline=", 0) == 0)
+		return ParseNumber(arg.substr(11), config.deadline, 0.0, 1e9);
+	else if (arg.rfind("--matches=", 0) == 0)
+		return ParseNumber(arg.substr(10), config.matches, 1u, 1u << 20);
+	else if (arg.rfind("--blur-passes=", 0) == 0)
+		return ParseNumber(arg.substr(14), config.blur_passes, 0u, 64u);
+	else if (arg == "--order=fixed")
+		config.order = ScaleOrder::Fixed;
+	else if (arg == "--order=likely")
+		config.order = ScaleOrder::Likely;
+	else if (arg == "--blur=gaussian")
+		config.blur = BlurMode::Gaussian;
+	else if (arg == "--blur=box")
+		config.blur = BlurMode::Box;
+	else if (arg == "--blur=pyramid")
+		config.blur = BlurMode::Pyramid;
+	else if (arg == "--stats=integral")
+		config.stats = StatsMode::Integral;
+	else if (arg == "--stats=running")
+		config.stats = StatsMode::Running;
+	else if (arg == "--peaks=threshold")
+		config.peaks = PeakMode::Threshold;
+	else if (arg == "--peaks=local-max")
+		config.peaks = PeakMode::LocalMax;
+	else if (arg.rfind("--threads=", 0) == 0)
+		return ParseNumber(arg.substr(10), config.threads, 0u, 1024u);
+	else if (arg == "--affinity")
+		config.affinity = true;
+	else if (arg == "--heatmap=none")
+		config.heatmap = HeatmapFormat::None;
+	else if (arg == "--heatmap=f16")
+		config.heatmap = HeatmapFormat::Float16;
+	else if (arg == "--heatmap=u8")
+		config.heatmap = HeatmapFormat::UInt8;
+	else if (arg == "--output=text")
+		config.output = ResultFormat::Text;
+	else if (arg == "--output=csv")
+		config.output = ResultFormat::CSV;
+	else if (arg == "--output=jsonl")
+		config.output = ResultFormat::JSONL;
+	else if (arg.rfind("--trace=", 0) == 0)
+		config.trace = arg.substr(8);
+	else if (arg.rfind("--cache=", 0) == 0)
+		return ParseNumber(arg.substr(8), config.cache, 0u, 1u << 20);
+	else if (arg == "--incremental")
+		config.incremental = true;
+	else if (arg.rfind("--config=", 0) == 0)
+		return LoadConfig(arg.substr(9), config);
+	else
+		return false;
+	return true;
+}
+
+// the deadline is left out, only complete searches are cached. so are the options for the files written and
+// --incremental, which finds the same maps.
+uint64_t ConfigHash(const MATCHCONFIG& config)
+{
+	PixelHash hash;
+	auto add = [&](const auto& field) { hash.Update(&field, sizeof(field)); };
+	add(config.scale_min);
+	add(config.scale_max);
+	add(config.scale_step);
+	add(config.scale_auto);
+	add(config.min_object);
+	add(config.max_scales);
+	add(config.order);
+	add(config.threshold);
+	add(config.stop);
+	add(config.stop_accuracy);
+	add(config.stop_ncc);
+	add(config.stop_margin);
+	add(config.stop_sharpness);
+	add(config.matches);
+	add(config.blur);
+	add(config.blur_passes);
+	add(config.stats);
+	add(config.peaks);
+	add(config.threads);   // the second peak of the confidence stop knows the maximum of every tile
+	return hash.Digest();
+}
 
-void DownSample(CBitmap* bmp)
+// one option per line as on the command line, blank lines and everything after # are ignored
+bool LoadConfig(const std::string& filename, MATCHCONFIG& config)
 {
-	unsigned int width = bmp->GetWidth();
-	unsigned int height = bmp->GetHeight();
-	
-	// initialize a matrix
-	matrix<RGBA> pixels(height, width);
+	std::ifstream file(filename);
+	if (!file)
+	{
+		std::cerr << "cannot read " << filename << '\n';
+		return false;
+	}
 
-	for (unsigned int i = 0; i < height; ++i)
+	unsigned int number = 0;
+	for (std::string line; std::getline(file, line); )
 	{
-		for (unsigned int j = 0; j < width; ++j)
+		++number;
+		line = line.substr(0, line.find('#'));
+		auto begin = line.find_first_not_of(" \t\r");
+		if (begin == std::string::npos)
+			continue;
+		auto option = line.substr(begin, line.find_last_not_of(" \t\r") - begin + 1);
+		if (!ParseOption(option, config))
 		{
-			pixels[i][j] = bmp->m_BitmapData[(height - i - 1) * width + j];
+			OptionError(option, filename + ':' + std::to_string(number) + ": ");
+			return false;
 		}
 	}
+	return true;
+}
+
+float IoU(const BOX& a, const BOX& b)
+{
+	unsigned int left = std::max(a.x, b.x);
+	unsigned int top = std::max(a.y, b.y);
+	unsigned int right = std::min(a.x + a.width, b.x + b.width);
+	unsigned int bottom = std::min(a.y + a.height, b.y + b.height);
+	if (right <= left || bottom <= top)
+		return 0.0f;
+
+	double intersection = (double) (right - left) * (bottom - top);
+	return (float) (intersection / ((double) a.width * a.height + (double) b.width * b.height - intersection));
+}
+
+// sorts the hypotheses by a cheap guess of how well the template matches at each scale, best first. the
+// guess is how many standard deviations the best NCC of the template halved with the binomial kernel stands
+// out of the map of a thumbnail of the scaled image. the best NCC alone hardly differs between the scales,
+// it grows with the number of positions and the texture. the map is about a sixteenth of the work of the
+// full NCC, and it runs on the workers. the thumbnails come from the
+// pyramid of the ScaleCache, so no hypothesis is resampled at full size for them. the order of hypotheses
+// that cannot be guessed is kept, they go last, and so do the ones left when the deadline passes.
+static void RankHypotheses(ScaleCache& scales, ImageView<const uint8_t> templ_gray, std::vector<HYPOTHESIS>& hypotheses, NCCWorkers& workers,
+	std::chrono::steady_clock::time_point deadline)
+{
+	PJ1_TRACE("RankHypotheses");
+
+	// a thumbnail under 4 pixels says too little
+	if (templ_gray.width < 8 || templ_gray.height < 8)
+		return;
 
-	unsigned int index = 0;
-	for (unsigned int i = 0; i < height; i += 2)
+	Image<uint8_t> templ_thumb(HalfLength(templ_gray.width), HalfLength(templ_gray.height));
+	PyrDown(templ_gray, templ_thumb.View());
+	TemplateStats templ_stats;
+	templ_stats.Build(templ_thumb.View());
+
+	// reused for every scale
+	Image<uint8_t> thumb;
+
+	std::vector<std::pair<float, HYPOTHESIS>> ranked;
+	for (auto& hypothesis : hypotheses)
 	{
-		for (unsigned int j = 0; j < width; j += 2)
+		float score = -1.0f;
+		if (std::chrono::steady_clock::now() < deadline)
 		{
-			bmp->m_BitmapData[index] = pixels[height - i - 1][j];
-			index++;
+			scales.Thumbnail(hypothesis.scale_width, hypothesis.scale_height, thumb);
+			if (thumb.View().width >= templ_thumb.View().width && thumb.View().height >= templ_thumb.View().height)
+			{
+				// no NCC value is above 1, so no peaks are collected, only the summary. a map the deadline
+				// cut short is no guess
+				bool complete = workers.Run(thumb.View(), templ_stats, StatsMode::Integral, PeakMode::Threshold, 1.0f, nullptr, deadline);
+				NCCSUMMARY summary = workers.Summary();
+				if (complete && summary.deviation > 0.0f)
+					score = (summary.best.ncc - summary.mean) / summary.deviation;
+			}
 		}
+		ranked.push_back({score, hypothesis});
 	}
 
-	bmp->m_BitmapHeader.Width = width % 2 ? width / 2 + 1 : width / 2;
-	bmp->m_BitmapHeader.Height = height % 2 ? height / 2 + 1 : height / 2;
-	bmp->m_BitmapSize = bmp->GetWidth() * bmp->GetHeight();
+	std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+	for (size_t k = 0; k < ranked.size(); ++k)
+		hypotheses[k] = ranked[k].second;
 }
 
-void DownSampleNTimes(CBitmap* bmp, unsigned int times)
+void FrameMaps::SetTemplate(ImageView<const uint8_t> templ_gray)
 {
-	for (int i = 0; i < times; ++i)
+	PixelHash hash;
+	for (unsigned int i = 0; i < templ_gray.height; ++i)
+		hash.Update(templ_gray[i], templ_gray.width);
+	if (hash.Digest() != templ)
+		maps.clear();
+	templ = hash.Digest();
+}
+
+// the NCC peaks of every feasible scale hypothesis in turn, in the order of config.order. visit(hypothesis,
+// workers) looks at the peaks of one scale and returns false to stop. with frames the maps of the last
+// frame are updated instead of computed anew.
+// anytime: with ScaleOrder::Likely, the default, the search is coarse to fine, the thumbnails rank the
+// scales before the full maps are searched best first. ScaleOrder::Fixed keeps its order under a deadline
+// too. at the deadline a scale that is under way is visited with the peaks of its rows so far and false is
+// returned, true means the search completed or visit stopped it.
+template <typename Visit>
+bool SearchScales(ImageView<const uint8_t> image_gray, ImageView<const uint8_t> templ_gray, const TemplateStats& templ_stats, const MATCHCONFIG& config, NCCWorkers& workers, HeatmapWriter* heatmaps,
+	FrameMaps* frames, std::chrono::steady_clock::time_point deadline, Visit&& visit)
+{
+	auto centered = templ_stats.Centered();
+
+	// scales where the image is smaller than the template are planned away, without any of them the image
+	// is not even filtered
+	auto hypotheses = ScaleHypotheses(config, image_gray.width, image_gray.height, centered.width, centered.height);
+	if (hypotheses.empty())
+		return true;
+	if (std::chrono::steady_clock::now() >= deadline)
+		return false;
+
+	// filtering and downscaling that every scale shares happens once
+	bool rank = config.order == ScaleOrder::Likely && hypotheses.size() > 1;
+	ScaleCache scales;
+	scales.Build(image_gray, config, hypotheses, &workers, rank);
+
+	if (rank)
+		RankHypotheses(scales, templ_gray, hypotheses, workers, deadline);
+	if (frames)
+		frames->SetTemplate(templ_gray);
+
+	// reused for every scale
+	Image<uint8_t> scaled;
+
+	for (auto& hypothesis : hypotheses)
 	{
-		DownSample(bmp);
+		if (std::chrono::steady_clock::now() >= deadline)
+			return false;
+
+		unsigned int scaled_width = ScaledLength(image_gray.width, hypothesis.scale_width);
+		unsigned int scaled_height = ScaledLength(image_gray.height, hypothesis.scale_height);
+
+		scales.Resample(hypothesis.scale_width, hypothesis.scale_height, scaled);
+
+		HEATMAP heatmap;
+		if (heatmaps)
+		{
+			heatmap.scale_width = hypothesis.scale_width;
+			heatmap.scale_height = hypothesis.scale_height;
+			heatmap.width = scaled_width - centered.width + 1;
+			heatmap.height = scaled_height - centered.height + 1;
+			heatmap.format = config.heatmap;
+			heatmap.data.resize(static_cast<size_t>(heatmap.width) * heatmap.height * heatmap.SampleSize());
+		}
+
+		bool complete = frames ?
+			workers.Update(scaled.View(), templ_stats, config.peaks, config.threshold, frames->Find(hypothesis), heatmaps ? &heatmap : nullptr, deadline) :
+			workers.Run(scaled.View(), templ_stats, config.stats, config.peaks, config.threshold, heatmaps ? &heatmap : nullptr, deadline);
+		if (heatmaps)
+			heatmaps->Write(std::move(heatmap));
+
+		if (!visit(hypothesis, static_cast<const NCCWorkers&>(workers)))
+			break;
+		if (!complete)
+			return false;
 	}
+	return true;
 }
 
-int Clamp(int x, int min, int max)
+// the box in the source image of a peak of the NCC map of one scale
+BOX SourceBox(const HYPOTHESIS& hypothesis, const PEAK& peak, unsigned int image_width, unsigned int image_height, unsigned int templ_width, unsigned int templ_height)
 {
-	if (x < min) return min;
-	if (x > max) return max;
-	return x;
+	auto x = Clamp(static_cast<unsigned int>(peak.x / hypothesis.scale_width), 0, image_width);
+	auto y = Clamp(static_cast<unsigned int>(peak.y / hypothesis.scale_height), 0, image_height);
+	return {static_cast<unsigned int>(x), static_cast<unsigned int>(y),
+		static_cast<unsigned int>(templ_width / hypothesis.scale_width), static_cast<unsigned int>(templ_height / hypothesis.scale_height)};
 }
 
-// only support downscaling
-void NearestScaling(CBitmap* bmp, float scaleWidth, float scaleHeight)
+// the best top matches of every scale by NCC, a match that overlaps a better one by more than half is dropped.
+// with StopMode::Confidence the search ends once top scales had a clear peak at different places.
+std::vector<DETECTION> DetectTemplate(ImageView<const uint8_t> image_gray, ImageView<const uint8_t> templ_gray, const MATCHCONFIG& config, NCCWorkers& workers, FrameMaps* frames, unsigned int top,
+	std::chrono::steady_clock::time_point deadline, bool& complete)
 {
-	if (scaleWidth > 1 || scaleHeight > 1) return;
+	TemplateStats templ_stats;
+	templ_stats.Build(templ_gray);
+
+	auto source_box = [&](const HYPOTHESIS& hypothesis, const PEAK& peak)
+	{
+		return SourceBox(hypothesis, peak, image_gray.width, image_gray.height, templ_gray.width, templ_gray.height);
+	};
+
+	std::vector<DETECTION> candidates;
+	std::vector<BOX> confident;
+	complete = SearchScales(image_gray, templ_gray, templ_stats, config, workers, nullptr, frames, deadline, [&](const HYPOTHESIS& hypothesis, const NCCWorkers& ncc)
+	{
+		for (unsigned int t = 0; t < ncc.Tiles(); ++t)
+			for (const PEAK& peak : ncc.Peaks(t))
+				candidates.push_back({source_box(hypothesis, peak), peak.ncc});
+
+		if (config.stop != StopMode::Confidence)
+			return true;
 
-	unsigned int src_width = bmp->GetWidth();
-	unsigned int src_height = bmp->GetHeight();
+		NCCSUMMARY summary = ncc.Summary();
+		if (!Confident(summary, config))
+			return true;
 
-	auto dst_width = static_cast<unsigned int>(src_width * scaleWidth);
-	auto dst_height = static_cast<unsigned int>(src_height * scaleHeight);
+		BOX box = source_box(hypothesis, summary.best);
+		bool overlaps = false;
+		for (auto& other : confident)
+			overlaps = overlaps || IoU(box, other) > 0.5f;
+		if (!overlaps)
+			confident.push_back(box);
+		return confident.size() < top;
+	});
 
-	matrix<RGBA> src_pixels(src_height, src_width);
+	std::stable_sort(candidates.begin(), candidates.end(), [](const DETECTION& a, const DETECTION& b) { return a.ncc > b.ncc; });
 
-	for (unsigned int i = 0; i < src_height; ++i)
+	std::vector<DETECTION> detections;
+	for (auto& candidate : candidates)
 	{
-		for (unsigned int j = 0; j < src_width; ++j)
-		{
-			src_pixels[i][j] = bmp->m_BitmapData[(src_height - i - 1) * src_width + j];
-		}
+		if (detections.size() >= top)
+			break;
+
+		bool overlaps = false;
+		for (auto& detection : detections)
+			overlaps = overlaps || IoU(candidate.box, detection.box) > 0.5f;
+		if (!overlaps)
+			detections.push_back(candidate);
 	}
+	return detections;
+}
+
+// config.deadline after begin, or never
+std::chrono::steady_clock::time_point Deadline(std::chrono::steady_clock::time_point begin, const MATCHCONFIG& config)
+{
+	if (config.deadline <= 0.0)
+		return std::chrono::steady_clock::time_point::max();
+	return begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(config.deadline));
+}
 
-	matrix<RGBA> dst_pixels(dst_height, dst_width);
+// nearest rank, sorted must not be empty
+double Percentile(const std::vector<double>& sorted, double p)
+{
+	auto rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+	return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
 
-	for (unsigned int i = 0; i < dst_height; ++i)
+// the matches of detections that overlap ground_truth[num], best accuracy first
+static std::vector<OUTPUTFORMAT> ScoreMatches(const std::vector<DETECTION>& detections, int num)
+{
+	std::vector<OUTPUTFORMAT> res;
+	for (auto& detection : detections)
 	{
-		for (unsigned int j = 0; j < dst_width; ++j)
-		{
-			auto src_i = Clamp(static_cast<unsigned int>(i / scaleHeight), 0, src_height);
-			auto src_j = Clamp(static_cast<unsigned int>(j / scaleWidth), 0, src_width);
+		int src_j = static_cast<int>(detection.box.x);
+		int src_i = static_cast<int>(detection.box.y);
+		unsigned int templ_scaled_width = detection.box.width;
+		unsigned int templ_scaled_height = detection.box.height;
+
+		auto S = templ_scaled_width * templ_scaled_height;
+		unsigned int I = 0;
+		if (std::abs(src_j - (int)ground_truth[num].x) >= templ_scaled_width || std::abs(src_i - (int)ground_truth[num].y) >= templ_scaled_height)
+			continue;
+		else
+			I = (templ_scaled_width - std::abs(src_j - (int)ground_truth[num].x)) * ( templ_scaled_height - std::abs(src_i - (int)ground_truth[num].y));
+
+		OUTPUTFORMAT output;
+		output.x = src_j;
+		output.y = src_i;
+		output.accuracy = (float) I / S;
+		output.IoU = (float) I / (2 * S - I);
+		output.templ_scaled_width = templ_scaled_width;
+		output.templ_scaled_height = templ_scaled_height;
+
+		res.push_back(output);
+	}
 
-			dst_pixels[i][j] = src_pixels[src_i][src_j];
-		}
+	std::sort(res.begin(), res.end(), DescendingWithAccuracy);
+	return res;
+}
+
+// the peaks of image_bmp against templ_bmp at the scale that stopped the search, or else at the scale with
+// the best NCC peak. complete is false if the deadline cut the search short. only StopMode::Accuracy looks
+// at ground_truth[num] here, to decide where to stop.
+static std::vector<DETECTION> SearchImage(int num, std::chrono::steady_clock::time_point stamp_begin, bool& complete)
+{
+	// gray planes of the image and the template
+	// coordinate system: the top left corner is (0, 0), the X-axis points to the right and the Y-axis
+	// downwards. just like DirectX and Photoshop.
+	// the original image is kept for drawing.
+	Image<uint8_t> image_full_gray(image_bmp->GetWidth(), image_bmp->GetHeight());
+	Image<uint8_t> templ_gray(templ_bmp->GetWidth(), templ_bmp->GetHeight());
+	{
+		PJ1_STAGE(Gray);
+		ConvertToGrayscale(BitmapView(static_cast<const CBitmap*>(image_bmp.get())), image_full_gray.View());
+		ConvertToGrayscale(BitmapView(templ_bmp.get()), templ_gray.View());
+	}
+	TemplateStats templ_stats;
+	templ_stats.Build(templ_gray.View());
+
+	NCCWorkers ncc_workers(WorkerCount(config.threads), config.affinity);
+
+	// heatmap_input1.ncc next to output_input1.bmp
+	std::unique_ptr<HeatmapWriter> heatmaps;
+	if (config.heatmap != HeatmapFormat::None)
+	{
+		auto heatmap_name = "heatmap_" + image_name.substr(0, image_name.find_last_of('.')) + ".ncc";
+		heatmaps = std::make_unique<HeatmapWriter>(heatmap_name, config.heatmap);
+		if (!heatmaps->IsOpen())
+			std::cerr << "cannot write " << heatmap_name << '\n';
 	}
- 
-	unsigned int index = 0;
-	for (unsigned int i = 0; i < dst_height; i ++)
+
+	std::vector<DETECTION> res;
+	float res_ncc = -std::numeric_limits<float>::infinity();
+
+	// reused for every scale
+	std::vector<DETECTION> scale_res;
+
+	complete = SearchScales(image_full_gray.View(), templ_gray.View(), templ_stats, config, ncc_workers, heatmaps.get(), nullptr, Deadline(stamp_begin, config), [&](const HYPOTHESIS& hypothesis, const NCCWorkers& ncc)
 	{
-		for (unsigned int j = 0; j < dst_width; j ++)
+		// store results
+		scale_res.clear();
+		for (unsigned int t = 0; t < ncc.Tiles(); ++t)
+			for (const PEAK& peak : ncc.Peaks(t))
+				scale_res.push_back({SourceBox(hypothesis, peak, image_bmp->GetWidth(), image_bmp->GetHeight(), templ_bmp->GetWidth(), templ_bmp->GetHeight()), peak.ncc});
+
+		NCCSUMMARY summary = ncc.Summary();
+		bool stop = false;
+		if (config.stop == StopMode::Accuracy)
+		{
+			auto scored = ScoreMatches(scale_res, num);
+			stop = scored.size() > 0 && scored[0].accuracy >= config.stop_accuracy;
+		}
+		else if (config.stop == StopMode::Confidence)
+			stop = Confident(summary, config);
+
+		if (stop || summary.best.ncc > res_ncc)
 		{
-			bmp->m_BitmapData[index] = dst_pixels[dst_height - i - 1][j];
-			index++;
+			res.swap(scale_res);
+			res_ncc = summary.best.ncc;
 		}
+		return !stop;
+	});
+
+	return res;
+}
+
+void TemplateMatching(int num, ResultSink& results, size_t job, bool save)
+{
+	PJ1_TRACE("TemplateMatching");
+	// timer
+	auto stamp_begin = std::chrono::steady_clock::now();
+
+	// read .bmp files, each one is decoded only once
+	image_bmp = std::make_unique<CBitmap>();
+	CBitmap templ;
+	bool loaded;
+	{
+		PJ1_STAGE(Load);
+		loaded = image_bmp->Load(image_name.c_str()) && templ.Load(templ_name.c_str());
+	}
+	if (!loaded)
+	{
+		std::cerr << "cannot read " << image_name << " or " << templ_name << '\n';
+		results.Skip(job);
+		return;
 	}
+	templ_bmp = std::move(templ).Share();
+
+	bool complete = true;
+	auto res = ScoreMatches(SearchImage(num, stamp_begin, complete), num);
 
-	bmp->m_BitmapHeader.Width = dst_width;
-	bmp->m_BitmapHeader.Height = dst_height;
-	bmp->m_BitmapSize = bmp->GetSize();
-	//std::cout << dst_width << ' ' << dst_height << '\n';
+	auto stamp_end = std::chrono::steady_clock::now();
+
+	if (res.size() > config.matches)
+		res.resize(config.matches);
+
+	if (save)
+		for (auto& output : res)
+			DrawRectangle(BitmapView(image_bmp.get()), output.x, output.y, output.templ_scaled_width, output.templ_scaled_height);
+
+	results.Submit(job, {image_name, res, std::chrono::duration<double, std::milli>(stamp_end - stamp_begin).count(), complete});
+
+	if (save)
+	{
+		std::string output_name = "output_" + image_name;
+		image_bmp->Save(output_name.c_str());
+	}
 
 }
 
-bool DescendingWithAccuracy(OUTPUTFORMAT a, OUTPUTFORMAT b)
+
+//****************************************************************************************************************//
+// pj1_evaluate: judges speed and accuracy together on a dataset with ground truth boxes.
+// the ground truth file has one box per line, paths are relative to the file, # starts a comment:
+//   image.bmp template.bmp x y width height
+// lines with the same image and template are one job, every job is matched on its own thread.
+// e.g.  Terminal:
+// D:pj1\build> .\pj1_evaluate.exe --jobs=8 dataset\ground_truth.txt
+//
+// besides the options of pj1 (--threads=N is per job here, 1 by default):
+// --jobs=N          jobs at once, 0 uses every core (default)
+// --iou=F           the IoU a detection needs to count as a hit, 0.5 by default
+// --top=N           detections kept per job, 0 keeps as many as the job has boxes (default)
+// --incremental     every --jobs thread is a stream of frames: a job with the template and image size of
+//                   the last job of its thread only computes the NCC again around the tiles that changed.
+//                   pj1_generate --frames=N writes such streams, --jobs=1 keeps them in order
+// --detections=FILE writes the detections of every job, "image template x y width height ncc" per line
+// --cache=N         keeps the detections of the last N distinct frames, a byte-identical frame later in the
+//                   same run is not searched again. emptied before every run of --warmup and --repeat
+//
+// as a regression benchmark it runs every job --warmup=N times unrecorded and --repeat=N times recorded,
+// and compares the median and the p95 latency of every job with a baseline file:
+// --repeat=N        recorded runs of every job, 1 by default
+// --warmup=N        unrecorded runs first, 0 by default
+// --baseline=FILE   fails if a job got slower than its line in FILE. if FILE does not exist it is written
+//                   and the exit code is 77, so CTest reports the first run as skipped rather than passed
+// --tolerance=F     how much slower counts as a regression, 0.1 (10%) by default
+// --update-baseline rewrites FILE with this run instead of comparing
+//
+// --scaling=FILE    writes the median latency and the throughput of every job against the image size and the
+//                   template area as CSV, for plotting the datasets of pj1_generate
+//****************************************************************************************************************//
+
+// the boxes of one image and template pair
+struct EVALJOB
 {
-	return a.accuracy > b.accuracy;
+	std::string name;    // image and template as the ground truth file has them
+	std::string image;
+	std::string templ;
+	std::vector<BOX> boxes;
+
+	// filled in by the worker
+	bool loaded = false;
+	unsigned int image_width = 0;
+	unsigned int image_height = 0;
+	unsigned int templ_width = 0;
+	unsigned int templ_height = 0;
+	std::vector<DETECTION> detections;
+	bool complete = true;   // false if the deadline cut the search short
+	double time = 0.0;   // ms, from loading to the last detection
+	std::vector<double> times;   // of every recorded run
+	unsigned int incomplete = 0;   // recorded runs the deadline cut short
+	bool hit = false;   // the detections came from the cache
+	unsigned int hits = 0;   // recorded runs served from the cache
+};
+
+// the latency of one job in the baseline file
+struct BASELINE
+{
+	double median;
+	double p95;
+};
+
+static bool ReadGroundTruth(const std::string& filename, std::vector<EVALJOB>& jobs)
+{
+	std::ifstream file(filename);
+	if (!file)
+		return false;
+
+	auto directory = std::filesystem::path(filename).parent_path();
+	std::map<std::pair<std::string, std::string>, size_t> index;
+	std::string line;
+	for (unsigned int number = 1; std::getline(file, line); ++number)
+	{
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		std::string image, templ;
+		BOX box;
+		if (!(fields >> image))
+			continue;
+		if (!(fields >> templ >> box.x >> box.y >> box.width >> box.height))
+		{
+			std::cerr << filename << ':' << number << ": expected image template x y width height\n";
+			return false;
+		}
+
+		auto [it, added] = index.emplace(std::make_pair(image, templ), jobs.size());
+		if (added)
+		{
+			EVALJOB& job = jobs.emplace_back();
+			job.name = image + ' ' + templ;
+			job.image = (directory / image).string();
+			job.templ = (directory / templ).string();
+		}
+		jobs[it->second].boxes.push_back(box);
+	}
+	return true;
 }
 
+// one "image template median p95" line per job
+static std::map<std::string, BASELINE> ReadBaseline(const std::string& filename)
+{
+	std::map<std::string, BASELINE> baseline;
+	std::ifstream file(filename);
+	std::string image, templ;
+	BASELINE latency;
+	while (file >> image >> templ >> latency.median >> latency.p95)
+		baseline[image + ' ' + templ] = latency;
+	return baseline;
+}
 
-void TemplateMatching(int num, bool save)
+static void EvaluateJob(EVALJOB& job, const MATCHCONFIG& config, NCCWorkers& workers, FrameMaps* frames, unsigned int top, ResultCache<std::vector<DETECTION>>* cache)
 {
-	// timer
+	PJ1_TRACE("EvaluateJob");
 	auto stamp_begin = std::chrono::steady_clock::now();
 
-	// read .bmp files
-	assert(image_bmp = std::make_unique<CBitmap>(image_name.c_str()));
-	assert(templ_bmp = std::make_unique<CBitmap>(templ_name.c_str()));
+	CBitmap image, templ;
+	{
+		PJ1_STAGE(Load);
+		if (!image.Load(job.image.c_str()) || !templ.Load(job.templ.c_str()))
+			return;
+	}
 
-	std::vector<OUTPUTFORMAT> res;
+	job.image_width = image.GetWidth();
+	job.image_height = image.GetHeight();
+	job.templ_width = templ.GetWidth();
+	job.templ_height = templ.GetHeight();
+
+	auto count = top > 0 ? top : static_cast<unsigned int>(job.boxes.size());
+	CACHEKEY key = {image.GetPixelHash(), templ.GetPixelHash(), ConfigHash(config), count};
+	std::optional<std::vector<DETECTION>> cached;
+	if (cache)
+		cached = cache->Find(key);
+
+	job.complete = true;
+	job.hit = cached.has_value();
+	if (cached)
+		job.detections = std::move(*cached);
+	else
+	{
+		Image<uint8_t> image_gray(image.GetWidth(), image.GetHeight());
+		Image<uint8_t> templ_gray(templ.GetWidth(), templ.GetHeight());
+		{
+			PJ1_STAGE(Gray);
+			ConvertToGrayscale(BitmapView(static_cast<const CBitmap*>(&image)), image_gray.View());
+			ConvertToGrayscale(BitmapView(static_cast<const CBitmap*>(&templ)), templ_gray.View());
+		}
+
+		job.detections = DetectTemplate(image_gray.View(), templ_gray.View(), config, workers, frames, count, Deadline(stamp_begin, config), job.complete);
+		if (cache && job.complete)
+			cache->Insert(key, job.detections);
+	}
+	job.loaded = true;
+
+	auto stamp_end = std::chrono::steady_clock::now();
+	job.time = std::chrono::duration<double, std::milli>(stamp_end - stamp_begin).count();
+}
+
+int Evaluate(int argc, char** argv)
+{
+	PJ1_STAGE_REPORT_AT_EXIT();
+
+	MATCHCONFIG config;
+	config.threads = 1;
+	unsigned int jobs_at_once = 0;
+	unsigned int top = 0;
+	float min_iou = 0.5f;
+	unsigned int repeat = 1;
+	unsigned int warmup = 0;
+	std::string baseline_name;
+	double tolerance = 0.1;
+	bool update_baseline = false;
+	std::string scaling_name;
+	std::string detections_name;
+	std::string ground_truth_name;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (ParseOption(arg, config))
+			continue;
+		bool valid = true;
+		if (arg.rfind("--jobs=", 0) == 0)
+			valid = ParseNumber(arg.substr(7), jobs_at_once, 0u, 1024u);
+		else if (arg.rfind("--iou=", 0) == 0)
+			valid = ParseNumber(arg.substr(6), min_iou, 0.0f, 1.0f);
+		else if (arg.rfind("--top=", 0) == 0)
+			valid = ParseNumber(arg.substr(6), top, 0u, 1u << 20);
+		else if (arg.rfind("--repeat=", 0) == 0)
+			valid = ParseNumber(arg.substr(9), repeat, 1u, 1u << 20);
+		else if (arg.rfind("--warmup=", 0) == 0)
+			valid = ParseNumber(arg.substr(9), warmup, 0u, 1u << 20);
+		else if (arg.rfind("--baseline=", 0) == 0)
+			baseline_name = arg.substr(11);
+		else if (arg.rfind("--tolerance=", 0) == 0)
+			valid = ParseNumber(arg.substr(12), tolerance, 0.0, 1e6);
+		else if (arg == "--update-baseline")
+			update_baseline = true;
+		else if (arg.rfind("--scaling=", 0) == 0)
+			scaling_name = arg.substr(10);
+		else if (arg.rfind("--detections=", 0) == 0)
+			detections_name = arg.substr(13);
+		else if (arg.rfind("--", 0) == 0 || !ground_truth_name.empty())
+			valid = false;
+		else
+			ground_truth_name = arg;
+
+		if (!valid)
+		{
+			OptionError(arg);
+			return 1;
+		}
+	}
+
+	if (!config.trace.empty())
+		Tracer::Start(config.trace);
+
+	std::vector<EVALJOB> jobs;
+	if (ground_truth_name.empty() || !ReadGroundTruth(ground_truth_name, jobs))
+	{
+		std::cerr << "usage: pj1_evaluate [options] ground_truth.txt\n";
+		return 1;
+	}
 
-	bool flag = false;
-	for (float scaleWidth = 0.150f; scaleWidth >= 0.05f; scaleWidth -= 0.050f)
+	// every thread takes the next job until none are left, the throughput is that of the last run
+	// shared by every job of a run and emptied before the next one, so that only frames repeated within the
+	// dataset hit and --repeat and --baseline still time real searches
+	std::unique_ptr<ResultCache<std::vector<DETECTION>>> cache;
+	if (config.cache > 0)
+		cache = std::make_unique<ResultCache<std::vector<DETECTION>>>(config.cache);
+
+	std::chrono::steady_clock::time_point stamp_begin, stamp_end;
+	for (unsigned int run = 0; run < warmup + repeat; ++run)
 	{
-		for (float scaleHeight = 0.05f; scaleHeight <= 0.150f; scaleHeight += 0.050f)
+		if (cache)
+			cache->Clear();
+		stamp_begin = std::chrono::steady_clock::now();
+		std::atomic<size_t> next = 0;
+		std::vector<std::thread> threads;
+		for (unsigned int t = 0; t < std::min<size_t>(WorkerCount(jobs_at_once), jobs.size()); ++t)
 		{
-			res.clear();
-			std::unique_ptr<CBitmap> image_bmp_copy;
-			assert(image_bmp_copy = std::make_unique<CBitmap>(image_name.c_str()));
-			GaussianFilterNTimes(image_bmp_copy.get(), 3);
-			NearestScaling(image_bmp_copy.get(), scaleWidth, scaleHeight);
-
-    		// get matrix of pixels in Grayscale
-    		// coordinate system: the top left corner is (0, 0), the X-axis points to the right and the Y-axis
-    		// downwards. just like DirectX and Photoshop.
-    		uint8_t* image_gray_buffer = new uint8_t[image_bmp_copy->GetSize()];
-    		RGBA* image_rgba_buffer = reinterpret_cast<RGBA*>(image_bmp_copy->GetBits());
-
-    		for (unsigned int i = 0; i < image_bmp_copy->GetSize(); ++i)
-       			image_gray_buffer[i] = R8G8B8A82GR(image_rgba_buffer[i]);
-
-    		matrix<uint8_t> image_gray_pixels(image_gray_buffer, image_bmp_copy->GetHeight(), image_bmp_copy->GetWidth());
-
-    		uint8_t* templ_gray_buffer = new uint8_t[templ_bmp->GetSize()];
-    		RGBA* templ_rgba_buffer = reinterpret_cast<RGBA*>(templ_bmp->GetBits());
-
-    		for (unsigned int i = 0; i < templ_bmp->GetSize(); ++i)
-       			templ_gray_buffer[i] = R8G8B8A82GR(templ_rgba_buffer[i]);
-
-    		matrix<uint8_t> templ_gray_pixels(templ_gray_buffer, templ_bmp->GetHeight(), templ_bmp->GetWidth());
-
-    		// template matching
-    		unsigned int rows = image_bmp_copy->GetHeight() - templ_bmp->GetHeight() + 1;
-    		unsigned int cols = image_bmp_copy->GetWidth() - templ_bmp->GetWidth() + 1;
-
-    		matrix<float> ncc(rows, cols);
-    		for (unsigned int i = 0; i < rows; ++i)
-    		{
-        		for (unsigned int j = 0; j < cols; ++j)
-        		{
-            		// the normalized cross correlation coefficient(NCC)
-            		// more information on math:https://blog.csdn.net/fb_help/article/details/104162770
-            		// i for image, t for template
-            		unsigned int i_sum = 0;
-            		unsigned int t_sum = 0;          
-            		for (unsigned int m = i; m < i + templ_bmp->GetHeight(); ++m)
-            		{
-                		for (unsigned int n = j; n < j + templ_bmp->GetWidth(); ++n)
-                		{
-                    		i_sum += image_gray_pixels[m][n];
-                    		t_sum += templ_gray_pixels[m - i][n - j];
-                		}
-            		}
-            		float i_mean = (float)i_sum / templ_bmp->GetSize();
-            		float t_mean = (float)t_sum / templ_bmp->GetSize();
-
-            		float i_standard_deviation = 0;
-            		float t_standard_deviation = 0;
-            		for (unsigned int m = i; m < i + templ_bmp->GetHeight(); ++m)
-            		{
-                		for (unsigned int n = j; n < j + templ_bmp->GetWidth(); ++n)
-                		{
-                    		i_standard_deviation += std::pow(image_gray_pixels[m][n] - i_mean, 2);
-                    		t_standard_deviation += std::pow(templ_gray_pixels[m - i][n - j] - t_mean, 2);
-                		}
-            		}
-            		i_standard_deviation = std::sqrt(i_standard_deviation / (float) templ_bmp->GetSize());
-            		t_standard_deviation = std::sqrt(t_standard_deviation / (float) templ_bmp->GetSize());
-
-            		float num1 = 1.0f / (i_standard_deviation * t_standard_deviation * templ_bmp->GetSize());
-            		float r = 0;
-            		for (unsigned int m = i; m < i + templ_bmp->GetHeight(); ++m)
-            		{
-                		for (unsigned int n = j; n < j + templ_bmp->GetWidth(); ++n)
-                		{
-                 			r += (image_gray_pixels[m][n] - i_mean) * (templ_gray_pixels[m - i][n - j] - t_mean);            
-                		}
-            		}
-            		r *= num1;
-
-            		ncc[i][j] = r;
-        		}      
-        
-    		}
-
-			// store results
-			auto templ_scaled_width = static_cast<unsigned int>(templ_bmp->GetWidth() / scaleWidth);
-			auto templ_scaled_height = static_cast<unsigned int>(templ_bmp->GetHeight() / scaleHeight);
-
-			for (unsigned int i = 0; i < rows; ++i)
+			threads.emplace_back([&]
 			{
-				for (unsigned int j = 0; j < cols; ++j)
+				// every thread is one stream of frames for --incremental
+				NCCWorkers workers(WorkerCount(config.threads), config.affinity);
+				FrameMaps frames;
+				for (size_t k; (k = next++) < jobs.size(); )
+					EvaluateJob(jobs[k], config, workers, config.incremental ? &frames : nullptr, top, cache.get());
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+		stamp_end = std::chrono::steady_clock::now();
+
+		if (run >= warmup)
+			for (auto& job : jobs)
+				if (job.loaded)
 				{
-					if (ncc[i][j] > 0.6f)
-					{
-						auto src_i = Clamp(static_cast<unsigned int>(i / scaleHeight), 0, image_bmp->GetHeight());
-			    			auto src_j = Clamp(static_cast<unsigned int>(j / scaleWidth), 0, image_bmp->GetWidth());
-						
-						auto S = templ_scaled_width * templ_scaled_height;
-						unsigned int I = 0;
-						if (std::abs(src_j - (int)ground_truth[num].x) >= templ_scaled_width || std::abs(src_i - (int)ground_truth[num].y) >= templ_scaled_height) 
-							continue;
-						else
-				 			I = (templ_scaled_width - std::abs(src_j - (int)ground_truth[num].x)) * ( templ_scaled_height - std::abs(src_i - (int)ground_truth[num].y));
-					
-						OUTPUTFORMAT output;
-						output.x = src_j;
-						output.y = src_i;
-						output.accuracy = (float) I / S;
-						output.IoU = (float) I / (2 * S - I);
-						output.templ_scaled_width = templ_scaled_width;
-						output.templ_scaled_height = templ_scaled_height;
-
-						res.push_back(output);
-				
-					}
-				
+					job.times.push_back(job.time);
+					job.incomplete += !job.complete;
+					job.hits += job.hit;
 				}
-			}
-
-			delete[] image_gray_buffer; image_gray_buffer = nullptr;
-	        	delete[] templ_gray_buffer;	templ_gray_buffer = nullptr;
+	}
 
-			std::sort(res.begin(), res.end(), DescendingWithAccuracy);
-			if (res.size() > 0 && res[0].accuracy >= 0.8f)
+	// every detection may hit one box, the best detections choose first
+	size_t boxes = 0, detections = 0, hits = 0, loaded = 0;
+	double hit_iou = 0.0;
+	std::vector<double> times;
+	std::vector<unsigned int> job_hits(jobs.size());
+	for (auto& job : jobs)
+	{
+		boxes += job.boxes.size();
+		if (!job.loaded)
+		{
+			std::cerr << "cannot read " << job.image << " or " << job.templ << '\n';
+			continue;
+		}
+		++loaded;
+		std::sort(job.times.begin(), job.times.end());
+		times.insert(times.end(), job.times.begin(), job.times.end());
+		detections += job.detections.size();
+
+		std::vector<bool> taken(job.boxes.size());
+		unsigned int& found = job_hits[&job - jobs.data()];
+		for (auto& detection : job.detections)
+		{
+			size_t best = job.boxes.size();
+			float best_iou = min_iou;
+			for (size_t b = 0; b < job.boxes.size(); ++b)
 			{
-				flag = true;
-				break;
+				float iou = IoU(detection.box, job.boxes[b]);
+				if (!taken[b] && iou >= best_iou)
+				{
+					best = b;
+					best_iou = iou;
+				}
 			}
+			if (best == job.boxes.size())
+				continue;
+
+			taken[best] = true;
+			++found;
+			hit_iou += best_iou;
 		}
+		hits += found;
+
+		std::cout << job.image << ": " << found << '/' << job.boxes.size() << " boxes found, " << Percentile(job.times, 50) << " ms";
+		if (repeat > 1)
+			std::cout << " (p95 " << Percentile(job.times, 95) << " ms)";
+		if (job.incomplete)
+			std::cout << ", deadline hit in " << job.incomplete << '/' << job.times.size() << " runs";
+		if (job.hits)
+			std::cout << ", cached in " << job.hits << '/' << job.times.size() << " runs";
+		std::cout << '\n';
+	}
+
+	std::sort(times.begin(), times.end());
+	double wall = std::chrono::duration<double>(stamp_end - stamp_begin).count();
+
+	std::cout << '\n';
+	std::cout << "jobs " << loaded << '/' << jobs.size() << " boxes " << boxes << " detections " << detections << '\n';
+	std::cout << "precision " << (detections ? (double) hits / detections : 0.0) << " recall " << (boxes ? (double) hits / boxes : 0.0)
+		<< " mean IoU of hits " << (hits ? hit_iou / hits : 0.0) << '\n';
+	if (!times.empty())
+	{
+		std::cout << "latency(ms) p50 " << Percentile(times, 50) << " p90 " << Percentile(times, 90) << " p95 " << Percentile(times, 95)
+			<< " p99 " << Percentile(times, 99) << " max " << times.back() << '\n';
+		std::cout << "throughput(jobs/s) " << loaded / wall << '\n';
+	}
 
-		if (flag)
-			break;		
+	if (!scaling_name.empty())
+	{
+		std::ofstream file(scaling_name, std::ios::trunc);
+		file << "image,width,height,megapixels,template_area,boxes,hits,median_ms,megapixels_per_s\n";
+		for (auto& job : jobs)
+		{
+			if (!job.loaded)
+				continue;
+			double megapixels = (double) job.image_width * job.image_height / 1e6;
+			double median = Percentile(job.times, 50);
+			file << std::format("{},{},{},{},{},{},{},{},{}\n", job.image, job.image_width, job.image_height, megapixels,
+				job.templ_width * job.templ_height, job.boxes.size(), job_hits[&job - jobs.data()], median, megapixels / median * 1000.0);
+		}
 	}
 
-	auto stamp_end = std::chrono::steady_clock::now();
-	
-	std::ofstream file("output.txt", std::ios::app);
-	file << image_name << ":\n";
-	file << "coordinates accuracy IoU\n";
+	// of the last run, without timings, so that two runs can be compared byte by byte
+	if (!detections_name.empty())
+	{
+		std::ofstream file(detections_name, std::ios::trunc);
+		for (auto& job : jobs)
+			for (auto& detection : job.detections)
+				file << job.name << ' ' << detection.box.x << ' ' << detection.box.y << ' ' << detection.box.width << ' ' << detection.box.height << ' ' << detection.ncc << '\n';
+		if (!file)
+		{
+			std::cerr << "cannot write " << detections_name << '\n';
+			return 1;
+		}
+	}
 
-	if (res.size() > 5)
-		res.resize(5);
+	if (loaded != jobs.size())
+		return 1;
+	if (baseline_name.empty())
+		return 0;
 
-	float sum = 0.0f;
+	auto baseline = ReadBaseline(baseline_name);
+	if (baseline.empty() || update_baseline)
+	{
+		std::ofstream file(baseline_name, std::ios::trunc);
+		for (auto& job : jobs)
+			file << job.name << ' ' << Percentile(job.times, 50) << ' ' << Percentile(job.times, 95) << '\n';
+		std::cout << "baseline written to " << baseline_name << '\n';
+		if (!file)
+			return 1;
+		// nothing was compared
+		return update_baseline ? 0 : 77;
+	}
 
-	for (auto& output : res)
+	// jobs the baseline does not know yet cannot regress
+	unsigned int regressions = 0;
+	for (auto& job : jobs)
 	{
-		file << '(' << output.x << ", " << output.y << ") " << output.accuracy << ' ' << output.IoU << '\n'; 
-		sum += output.accuracy;
+		auto it = baseline.find(job.name);
+		if (it == baseline.end())
+			continue;
 
-		if (save)
-			DrawRectangle(output.x, output.y, output.templ_scaled_width, output.templ_scaled_height);
+		double median = Percentile(job.times, 50);
+		double p95 = Percentile(job.times, 95);
+		if (median > it->second.median * (1.0 + tolerance) || p95 > it->second.p95 * (1.0 + tolerance))
+		{
+			std::cout << "regression " << job.name << ": median " << it->second.median << " -> " << median
+				<< " ms, p95 " << it->second.p95 << " -> " << p95 << " ms\n";
+			++regressions;
+		}
 	}
-	file << "average precision:" << (float) sum / res.size() << " " << "processing time(ms):" << 
-	std::chrono::duration<double, std::milli>(stamp_end - stamp_begin).count() << "\n\n";
-	file.close();
+	std::cout << regressions << " regressions against " << baseline_name << '\n';
+	return regressions ? 1 : 0;
+}
 
-	if (save)
+
+//****************************************************************************************************************//
+// pj1_generate: synthetic datasets for pj1_evaluate. every search image is smooth noise with copies of a
+// template pasted in at random positions, each copy enlarged by 1 / scale for a random scale hypothesis
+// of the matcher, so the matcher can find it at exactly that scale. DIR gets the images, the templates and
+// a ground_truth.txt for pj1_evaluate.
+// e.g.  Terminal:
+// D:pj1\build> .\pj1_generate.exe --sizes=1280x960,2560x1920 --template-sizes=8,16 synthetic
+// D:pj1\build> .\pj1_evaluate.exe --repeat=5 --top=4 --scaling=scaling.csv synthetic\ground_truth.txt
+//
+// --sizes=WxH,...          search image sizes, 640x480,1280x960,2560x1920 by default
+// --template-sizes=N,...   side lengths of the random square templates, 8,12,16 by default
+// --template=FILE          paste this template instead, --template-sizes is ignored
+// --copies=N               copies per image, 2 by default
+// --frames=N               N frames per image instead of one, each a patch of new noise away from the copies
+//                          after the last, for pj1_evaluate --incremental. 1 by default
+// --seed=N                 the same seed makes the same dataset, 1 by default
+// --scales=MIN:MAX:STEP    the scale hypotheses, the same as for the matcher that should find the copies
+// --scales=auto            and --min-object=N, --max-scales=N work as for the matcher too
+// --config=FILE            takes the scale options from a matcher config file
+//****************************************************************************************************************//
+
+// bilinear noise: random values on a grid of the given cell size, plus a little per pixel noise
+static void SmoothNoise(ImageView<uint8_t> gray, unsigned int cell, std::mt19937& rng)
+{
+	unsigned int grid_width = gray.width / cell + 2;
+	unsigned int grid_height = gray.height / cell + 2;
+	std::vector<float> grid(static_cast<size_t>(grid_width) * grid_height);
+	std::uniform_real_distribution<float> level(16.0f, 240.0f);
+	for (auto& value : grid)
+		value = level(rng);
+
+	std::uniform_int_distribution<int> grain(-8, 8);
+	for (unsigned int i = 0; i < gray.height; ++i)
 	{
-		std::string output_name = "output_" + image_name;
-		image_bmp->Save(output_name.c_str());
+		unsigned int gi = i / cell;
+		float fy = (float) (i % cell) / cell;
+		for (unsigned int j = 0; j < gray.width; ++j)
+		{
+			unsigned int gj = j / cell;
+			float fx = (float) (j % cell) / cell;
+			const float* top = &grid[static_cast<size_t>(gi) * grid_width + gj];
+			const float* bottom = top + grid_width;
+			float value = (top[0] * (1 - fx) + top[1] * fx) * (1 - fy) + (bottom[0] * (1 - fx) + bottom[1] * fx) * fy;
+			gray[i][j] = static_cast<uint8_t>(Clamp(static_cast<int>(value) + grain(rng), 0, 255));
+		}
 	}
-		
+}
+
+static bool SaveGray(ImageView<const uint8_t> gray, const std::string& filename)
+{
+	CBitmap bmp;
+	std::vector<uint32_t> opaque(static_cast<size_t>(gray.width) * gray.height, 0xFF000000);
+	bmp.SetBits(opaque.data(), gray.width, gray.height, 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+	GenerateGaryscaleImage(gray, BitmapView(&bmp));
+	return bmp.Save(filename.c_str());
+}
+
+static std::vector<std::string> SplitList(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream stream(list);
+	for (std::string item; std::getline(stream, item, ','); )
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+int Generate(int argc, char** argv)
+{
+	std::vector<std::string> sizes = {"640x480", "1280x960", "2560x1920"};
+	std::vector<std::string> template_sizes = {"8", "12", "16"};
+	std::string template_name;
+	unsigned int copies = 2;
+	unsigned int frames = 1;
+	unsigned int seed = 1;
+	std::string directory;
+	MATCHCONFIG config;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool valid = true;
+		if (arg.rfind("--scales=", 0) == 0 || arg.rfind("--min-object=", 0) == 0 || arg.rfind("--max-scales=", 0) == 0 || arg.rfind("--config=", 0) == 0)
+			valid = ParseOption(arg, config);
+		else if (arg.rfind("--sizes=", 0) == 0)
+			sizes = SplitList(arg.substr(8));
+		else if (arg.rfind("--template-sizes=", 0) == 0)
+			template_sizes = SplitList(arg.substr(17));
+		else if (arg.rfind("--template=", 0) == 0)
+			template_name = arg.substr(11);
+		else if (arg.rfind("--copies=", 0) == 0)
+			valid = ParseNumber(arg.substr(9), copies, 0u, 1024u);
+		else if (arg.rfind("--frames=", 0) == 0)
+			valid = ParseNumber(arg.substr(9), frames, 1u, 1024u);
+		else if (arg.rfind("--seed=", 0) == 0)
+			valid = ParseNumber(arg.substr(7), seed, 0u, std::numeric_limits<unsigned int>::max());
+		else if (arg.rfind("--", 0) == 0 || !directory.empty())
+			valid = false;
+		else
+			directory = arg;
+
+		if (!valid)
+		{
+			OptionError(arg);
+			return 1;
+		}
+	}
+	if (directory.empty())
+	{
+		std::cerr << "usage: pj1_generate [options] DIR\n";
+		return 1;
+	}
+
+	std::mt19937 rng(seed);
+	std::filesystem::create_directories(directory);
+	auto path = std::filesystem::path(directory);
+
+	// the templates and the names they are saved under
+	std::vector<std::pair<std::string, Image<uint8_t>>> templates;
+	if (!template_name.empty())
+	{
+		CBitmap bmp;
+		if (!bmp.Load(template_name.c_str()))
+		{
+			std::cerr << "cannot read " << template_name << '\n';
+			return 1;
+		}
+		Image<uint8_t> gray(bmp.GetWidth(), bmp.GetHeight());
+		ConvertToGrayscale(BitmapView(static_cast<const CBitmap*>(&bmp)), gray.View());
+		templates.emplace_back("template.bmp", std::move(gray));
+	}
+	else
+	{
+		for (auto& side : template_sizes)
+		{
+			unsigned int length = 0;
+			if (!ParseNumber(side, length, 1u, 1u << 16))
+			{
+				std::cerr << "bad template size " << side << '\n';
+				return 1;
+			}
+			Image<uint8_t> gray(length, length);
+			SmoothNoise(gray.View(), 2, rng);
+			templates.emplace_back(std::format("template_{}.bmp", length), std::move(gray));
+		}
+	}
+	for (auto& [name, gray] : templates)
+		SaveGray(gray.View(), (path / name).string());
+
+	std::ofstream ground_truth(path / "ground_truth.txt", std::ios::trunc);
+	ground_truth << "# written by pj1_generate --seed=" << seed << "\n# image template x y width height\n";
+
+	for (auto& size : sizes)
+	{
+		unsigned int width = 0, height = 0;
+		if (sscanf(size.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0)
+		{
+			std::cerr << "bad size " << size << '\n';
+			return 1;
+		}
+
+		for (auto& [templ_name, templ] : templates)
+		{
+			auto hypotheses = ScaleHypotheses(config, width, height, templ.GetWidth(), templ.GetHeight());
+			if (hypotheses.empty())
+			{
+				std::cerr << "no scale fits " << templ_name << " into " << size << '\n';
+				return 1;
+			}
+
+			Image<uint8_t> image(width, height);
+			SmoothNoise(image.View(), 32, rng);
+
+			// a copy keeps clear of the others, one that does not fit after a few tries is left out
+			std::vector<BOX> boxes;
+			for (unsigned int c = 0; c < copies; ++c)
+			{
+				for (int attempt = 0; attempt < 100; ++attempt)
+				{
+					auto& hypothesis = hypotheses[rng() % hypotheses.size()];
+					auto copy_width = static_cast<unsigned int>(templ.GetWidth() / hypothesis.scale_width);
+					auto copy_height = static_cast<unsigned int>(templ.GetHeight() / hypothesis.scale_height);
+					if (copy_width > width || copy_height > height)
+						continue;
+
+					BOX box = {static_cast<unsigned int>(rng() % (width - copy_width + 1)), static_cast<unsigned int>(rng() % (height - copy_height + 1)), copy_width, copy_height};
+					bool overlaps = false;
+					for (auto& other : boxes)
+						overlaps = overlaps || IoU(box, other) > 0.0f;
+					if (overlaps)
+						continue;
+
+					NearestScaling(templ.View(), image.View().Crop(box.x, box.y, box.width, box.height), 1.0f / hypothesis.scale_width, 1.0f / hypothesis.scale_height);
+					boxes.push_back(box);
+					break;
+				}
+			}
+
+			for (unsigned int f = 0; f < frames; ++f)
+			{
+				// a quarter sized patch of new noise that keeps clear of the copies, the frame stays the same if
+				// none fits after a few tries
+				if (f > 0)
+				{
+					BOX patch = {0, 0, std::max(1u, width / 4), std::max(1u, height / 4)};
+					for (int attempt = 0; attempt < 100; ++attempt)
+					{
+						patch.x = rng() % (width - patch.width + 1);
+						patch.y = rng() % (height - patch.height + 1);
+						bool overlaps = false;
+						for (auto& box : boxes)
+							overlaps = overlaps || IoU(patch, box) > 0.0f;
+						if (overlaps)
+							continue;
+
+						SmoothNoise(image.View().Crop(patch.x, patch.y, patch.width, patch.height), 8, rng);
+						break;
+					}
+				}
+
+				auto stem = templ_name.substr(0, templ_name.find_last_of('.'));
+				auto image_name = frames > 1 ? std::format("synthetic_{}x{}_{}_{:03}.bmp", width, height, stem, f) : std::format("synthetic_{}x{}_{}", width, height, templ_name);
+				if (!SaveGray(image.View(), (path / image_name).string()))
+				{
+					std::cerr << "cannot write " << (path / image_name).string() << '\n';
+					return 1;
+				}
+				for (auto& box : boxes)
+					ground_truth << image_name << ' ' << templ_name << ' ' << box.x << ' ' << box.y << ' ' << box.width << ' ' << box.height << '\n';
+			}
+		}
+	}
+
+	return ground_truth ? 0 : 1;
 }